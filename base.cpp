@@ -5,10 +5,16 @@
  */
 
 #include "base.h"
+#include "profiler.h"
+#include "replay.h"
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <climits>
+#include <condition_variable>
 #include <iostream>
+#include <mutex>
 #include <vector>
 
 // ----------------------------------------------------------------------------
@@ -16,12 +22,22 @@
 // ----------------------------------------------------------------------------
 volatile unsigned char key[256] = { 0 };
 volatile float delta_time = 0.f;
+unsigned long draw_calls = 0; // Added to by end_frame(), for the frames that have been drawn
 
 // ----------------------------------------------------------------------------
 // Internal SDL state
 // ----------------------------------------------------------------------------
 static SDL_Window *gWindow = nullptr;
 static SDL_Renderer *gRenderer = nullptr;
+static unsigned long gRenderCalls = 0; // Main thread
+
+// Sprites loaded since the last build_atlas(), with their surfaces
+struct PendingSprite {
+    Sprite *sprite;
+    SDL_Surface *surface;
+};
+static std::vector<PendingSprite> gPendingSprites;
+static std::vector<SDL_Texture *> gAtlasTextures;
 
 // ----------------------------------------------------------------------------
 // Audio state
@@ -33,6 +49,12 @@ static int gNextAudioStreamIndex = 0;
 static uint64_t gLastTicks = 0;
 static const bool *gKeyStates = nullptr;
 static SDL_Gamepad *gGamepad = nullptr;
+static float gGamepadLeftX = 0.f; // Game thread, see update_input_state()
+
+// Input sampled by the main thread, and gamepad rumble requested by the game thread
+static std::atomic<uint8_t> gSampledKeys { 0 }; // Bit n is set when key n is down
+static std::atomic<float> gSampledLeftX { 0.f };
+static std::atomic<uint64_t> gRumbleRequest { 0 }; // Low and high frequency and duration
 
 // ----------------------------------------------------------------------------
 // Gamepad helpers
@@ -79,6 +101,161 @@ void print_error(const char *fmt, ...)
     va_end(ap);
 }
 
+// ----------------------------------------------------------------------------
+// Sprite batch
+// ----------------------------------------------------------------------------
+// Sprites are collected as textured quads and submitted with a single SDL_RenderGeometry call
+// for each run of sprites sharing a texture. Points are collected as untextured quads of one
+// pixel, so any number of points with their own colours are drawn in one call as well. The
+// other drawing functions flush the batch first, so everything is still drawn in the order of
+// the draw commands.
+static SDL_Texture *gBatchTexture = nullptr;
+static std::vector<SDL_Vertex> gBatchVertices;
+static std::vector<int> gBatchIndices;
+
+static void flush_sprite_batch()
+{
+    if (gBatchVertices.empty())
+        return;
+
+    gRenderCalls++;
+    SDL_RenderGeometry(gRenderer,
+                       gBatchTexture,
+                       gBatchVertices.data(),
+                       static_cast<int>(gBatchVertices.size()),
+                       gBatchIndices.data(),
+                       static_cast<int>(gBatchIndices.size()));
+
+    gBatchVertices.clear();
+    gBatchIndices.clear();
+}
+
+static void batch_quad(SDL_Texture *texture, const SDL_FRect &dst, const SDL_FRect &uv, const SDL_FColor &color)
+{
+    if (texture != gBatchTexture) {
+        flush_sprite_batch();
+        gBatchTexture = texture;
+    }
+
+    const int first = static_cast<int>(gBatchVertices.size());
+    gBatchVertices.push_back({ { dst.x, dst.y }, color, { uv.x, uv.y } });
+    gBatchVertices.push_back({ { dst.x + dst.w, dst.y }, color, { uv.x + uv.w, uv.y } });
+    gBatchVertices.push_back({ { dst.x + dst.w, dst.y + dst.h }, color, { uv.x + uv.w, uv.y + uv.h } });
+    gBatchVertices.push_back({ { dst.x, dst.y + dst.h }, color, { uv.x, uv.y + uv.h } });
+
+    for (int i : { 0, 1, 2, 0, 2, 3 })
+        gBatchIndices.push_back(first + i);
+}
+
+// Adds a quad of one pixel for each point, given as a vertex with its position and colour
+static void batch_points(const SDL_Vertex *points, size_t n)
+{
+    if (gBatchTexture) {
+        flush_sprite_batch();
+        gBatchTexture = nullptr;
+    }
+
+    gBatchVertices.reserve(gBatchVertices.size() + 4 * n);
+    gBatchIndices.reserve(gBatchIndices.size() + 6 * n);
+    for (size_t i = 0; i < n; i++) {
+        const SDL_FPoint pos = points[i].position;
+        const SDL_FColor color = points[i].color;
+        const int first = static_cast<int>(gBatchVertices.size());
+        gBatchVertices.push_back({ pos, color, {} });
+        gBatchVertices.push_back({ { pos.x + 1.f, pos.y }, color, {} });
+        gBatchVertices.push_back({ { pos.x + 1.f, pos.y + 1.f }, color, {} });
+        gBatchVertices.push_back({ { pos.x, pos.y + 1.f }, color, {} });
+
+        for (int j : { 0, 1, 2, 0, 2, 3 })
+            gBatchIndices.push_back(first + j);
+    }
+}
+
+// ----------------------------------------------------------------------------
+// Draw commands
+// ----------------------------------------------------------------------------
+// The drawing functions record a command for each draw, with a sort key made of the draw
+// layer, an id for the texture and the depth. When the frame is drawn, the keys are sorted with
+// a radix sort, which is stable, and the commands are run in that order through the sprite
+// batch. Drawing into a layer is recorded too, but in the order it was requested, and run
+// before the other commands.
+//
+// The commands of a frame are recorded by the game thread and run by the main thread, which
+// owns the renderer. There are three frames: the one being recorded, the one being drawn and,
+// in between, the last one that was published. end_frame() and draw_frame() swap their frame
+// with the published one.
+struct DrawCommand {
+    enum Kind : uint8_t { QUAD, POINTS, RECT, LINE, TEXT, LAYER, BEGIN_LAYER, END_LAYER } kind;
+    SDL_Texture *texture; // QUAD
+    Layer *layer; // LAYER, BEGIN_LAYER and END_LAYER
+    SDL_FRect dst; // QUAD, RECT and LAYER: position and size, LINE: both ends, TEXT: position,
+                   // BEGIN_LAYER: region to redraw
+    SDL_FRect uv; // QUAD
+    SDL_FColor fcolor; // QUAD and LAYER
+    Color color; // RECT, LINE and TEXT
+    size_t text; // TEXT: offset in Frame::text
+    size_t points, nr_of_points; // POINTS: range in Frame::points
+};
+
+struct DrawKey {
+    uint32_t key; // Layer, texture id and depth, from the most significant byte down
+    uint32_t command;
+};
+
+struct Frame {
+    std::vector<DrawCommand> commands;
+    std::vector<DrawKey> keys;
+    std::vector<DrawCommand> layer_commands; // Drawing into layers, in order
+    std::vector<char> text;
+    std::vector<SDL_Vertex> points; // Position and colour of each point drawn with draw_points()
+    std::vector<const void *> textures; // Textures used, the id is the index + 1
+    std::vector<Layer *> destroyed_layers; // Destroyed after the frame has been drawn
+    unsigned long draw_calls = 0; // Render calls made to draw the frame
+};
+
+static Frame gFrames[3];
+static Frame *gRecordingFrame = &gFrames[0]; // Game thread
+static Frame *gPublishedFrame = &gFrames[1]; // Guarded by gFrameMutex
+static Frame *gDrawingFrame = &gFrames[2]; // Main thread
+static bool gFramePublished = false; // gPublishedFrame has not been drawn yet
+static bool gFramesStopped = false;
+static std::mutex gFrameMutex;
+static std::condition_variable gFrameSwapped;
+
+static std::vector<DrawKey> gSortedKeys;
+static uint32_t gDrawOrder = static_cast<uint32_t>(DL_OBJECTS) << 24;
+static bool gDrawingLayer = false; // Between begin_layer() and end_layer()
+
+void set_draw_order(DrawLayer layer, uint16_t depth)
+{
+    gDrawOrder = static_cast<uint32_t>(layer) << 24 | depth;
+}
+
+static uint32_t texture_id(const void *texture)
+{
+    if (!texture)
+        return 0;
+    std::vector<const void *> &textures = gRecordingFrame->textures;
+    size_t i = std::find(textures.begin(), textures.end(), texture) - textures.begin();
+    if (i == textures.size())
+        textures.push_back(texture);
+    return static_cast<uint32_t>(min<size_t>(i + 1, 255)); // Textures after the 254th share an id
+}
+
+static void add_command(const DrawCommand &c)
+{
+    Frame &frame = *gRecordingFrame;
+    if (gDrawingLayer) {
+        frame.layer_commands.push_back(c);
+        return;
+    }
+
+    const void *texture = c.kind == DrawCommand::LAYER ? static_cast<const void *>(c.layer) : c.texture;
+    const uint32_t key = (gDrawOrder & 0xFF00FFFF) | texture_id(texture) << 16;
+    frame.keys.push_back({ key, static_cast<uint32_t>(frame.commands.size()) });
+    frame.commands.push_back(c);
+}
+
 // ----------------------------------------------------------------------------
 // Drawing functions
 // ----------------------------------------------------------------------------
@@ -90,40 +267,89 @@ void draw_text(float x, float y, Color color, const char *fmt, ...)
     char buffer[512];
     va_list ap;
     va_start(ap, fmt);
-    vsnprintf(buffer, sizeof(buffer), fmt, ap);
+    const int length = vsnprintf(buffer, sizeof(buffer), fmt, ap);
     va_end(ap);
+    if (length < 0)
+        return;
 
-    SDL_SetRenderDrawColor(gRenderer, color.r, color.g, color.b, color.a);
-    SDL_RenderDebugText(gRenderer, x, y, buffer);
+    std::vector<char> &text = gRecordingFrame->text;
+    DrawCommand c {};
+    c.kind = DrawCommand::TEXT;
+    c.dst = { x, y, 0.f, 0.f };
+    c.color = color;
+    c.text = text.size();
+    text.insert(text.end(), buffer, buffer + min<size_t>(length, sizeof(buffer) - 1) + 1);
+    add_command(c);
 }
 
 void draw_rect(float x1, float y1, float x2, float y2, Color color)
 {
-    SDL_SetRenderDrawColor(gRenderer, color.r, color.g, color.b, color.a);
-    SDL_FRect r {
+    DrawCommand c {};
+    c.kind = DrawCommand::RECT;
+    c.dst = {
         x1,
         y1,
         x2 - x1 + 1,
         y2 - y1 + 1,
     };
-    SDL_RenderRect(gRenderer, &r);
+    c.color = color;
+    add_command(c);
 }
 
 void draw_line(float x1, float y1, float x2, float y2, Color color)
 {
-    SDL_SetRenderDrawColor(gRenderer, color.r, color.g, color.b, color.a);
-    SDL_RenderLine(gRenderer, x1, y1, x2, y2);
+    DrawCommand c {};
+    c.kind = DrawCommand::LINE;
+    c.dst = { x1, y1, x2, y2 };
+    c.color = color;
+    add_command(c);
+}
+
+static inline SDL_FColor to_fcolor(Color color)
+{
+    return { color.r / 255.f, color.g / 255.f, color.b / 255.f, color.a / 255.f };
+}
+
+static void add_quad(SDL_Texture *texture, const SDL_FRect &dst, const SDL_FRect &uv, const SDL_FColor &color)
+{
+    DrawCommand c {};
+    c.kind = DrawCommand::QUAD;
+    c.texture = texture;
+    c.dst = dst;
+    c.uv = uv;
+    c.fcolor = color;
+    add_command(c);
 }
 
 void draw_point(float x, float y, Color color)
 {
-    SDL_SetRenderDrawColor(gRenderer, color.r, color.g, color.b, color.a);
-    SDL_RenderPoint(gRenderer, x, y);
+    add_quad(nullptr, { x, y, 1.f, 1.f }, {}, to_fcolor(color));
+}
+
+void draw_points(size_t n, const float *x, const float *y, const float *alpha, Color color)
+{
+    if (n == 0)
+        return;
+
+    // A single command for all points, so the number of keys to sort does not grow with them
+    SDL_FColor fcolor = to_fcolor(color);
+    const float base_alpha = fcolor.a;
+    std::vector<SDL_Vertex> &points = gRecordingFrame->points;
+    DrawCommand c {};
+    c.kind = DrawCommand::POINTS;
+    c.points = points.size();
+    c.nr_of_points = n;
+    points.reserve(points.size() + n);
+    for (size_t i = 0; i < n; i++) {
+        fcolor.a = base_alpha * alpha[i];
+        points.push_back({ { x[i], y[i] }, fcolor, {} });
+    }
+    add_command(c);
 }
 
 void draw_sprite(Sprite *spr, float x, float y, float alpha)
 {
-    if (!spr || !spr)
+    if (!spr || !spr->texture)
         return;
 
     const SDL_FRect r = {
@@ -132,8 +358,248 @@ void draw_sprite(Sprite *spr, float x, float y, float alpha)
         static_cast<float>(spr->w),
         static_cast<float>(spr->h),
     };
-    SDL_SetTextureAlphaModFloat(spr, alpha);
-    SDL_RenderTexture(gRenderer, spr, nullptr, &r);
+    add_quad(spr->texture, r, spr->uv, { 1.f, 1.f, 1.f, clamp(alpha, 0.f, 1.f) });
+}
+
+// ----------------------------------------------------------------------------
+// Layers
+// ----------------------------------------------------------------------------
+// The game thread keeps track of the regions to redraw, the main thread owns the texture and
+// creates it when the layer is first drawn.
+struct Layer {
+    SDL_Texture *texture = nullptr; // Main thread
+    bool failed = false; // Creating the texture failed
+    bool dirty = true;
+    float x1 = 0.f, y1 = 0.f, x2 = SCREEN_W, y2 = SCREEN_H; // Region to redraw
+};
+
+static std::vector<Layer *> gLayers;
+static std::atomic<bool> gLayersLost { false }; // Set by the main thread when the render targets are reset
+
+Layer *create_layer()
+{
+    auto *layer = new Layer;
+    gLayers.push_back(layer);
+    return layer;
+}
+
+void destroy_layer(Layer *layer)
+{
+    if (!layer)
+        return;
+
+    gLayers.erase(std::remove(gLayers.begin(), gLayers.end(), layer), gLayers.end());
+    gRecordingFrame->destroyed_layers.push_back(layer);
+}
+
+void invalidate_layer(Layer *layer)
+{
+    invalidate_layer(layer, 0.f, 0.f, SCREEN_W, SCREEN_H);
+}
+
+void invalidate_layer(Layer *layer, float x1, float y1, float x2, float y2)
+{
+    if (!layer->dirty) {
+        layer->dirty = true;
+        layer->x1 = x1;
+        layer->y1 = y1;
+        layer->x2 = x2;
+        layer->y2 = y2;
+    } else {
+        layer->x1 = min(layer->x1, x1);
+        layer->y1 = min(layer->y1, y1);
+        layer->x2 = max(layer->x2, x2);
+        layer->y2 = max(layer->y2, y2);
+    }
+}
+
+bool begin_layer(Layer *layer)
+{
+    if (gLayersLost.exchange(false)) {
+        for (Layer *lost : gLayers)
+            invalidate_layer(lost);
+    }
+    if (!layer->dirty)
+        return false;
+
+    DrawCommand c {};
+    c.kind = DrawCommand::BEGIN_LAYER;
+    c.layer = layer;
+    c.dst = { layer->x1, layer->y1, layer->x2, layer->y2 };
+    gRecordingFrame->layer_commands.push_back(c);
+
+    gDrawingLayer = true;
+    return true;
+}
+
+void end_layer(Layer *layer)
+{
+    DrawCommand c {};
+    c.kind = DrawCommand::END_LAYER;
+    c.layer = layer;
+    gRecordingFrame->layer_commands.push_back(c);
+
+    layer->dirty = false;
+    gDrawingLayer = false;
+}
+
+void draw_layer(Layer *layer)
+{
+    DrawCommand c {};
+    c.kind = DrawCommand::LAYER;
+    c.layer = layer;
+    c.dst = { 0.f, 0.f, SCREEN_W, SCREEN_H };
+    c.fcolor = { 1.f, 1.f, 1.f, 1.f };
+    add_command(c);
+}
+
+// ----------------------------------------------------------------------------
+// Running the draw commands (main thread)
+// ----------------------------------------------------------------------------
+static SDL_Texture *layer_texture(Layer *layer)
+{
+    if (!layer->texture && !layer->failed) {
+        layer->texture =
+            SDL_CreateTexture(gRenderer, SDL_PIXELFORMAT_RGBA32, SDL_TEXTUREACCESS_TARGET, SCREEN_W, SCREEN_H);
+        if (!layer->texture) {
+            print_error("Warning: Failed to create layer texture (%s)", SDL_GetError());
+            layer->failed = true;
+        } else
+            SDL_SetTextureBlendMode(layer->texture, SDL_BLENDMODE_BLEND);
+    }
+    return layer->texture;
+}
+
+static void begin_layer_target(Layer *layer, const SDL_FRect &region)
+{
+    flush_sprite_batch();
+    SDL_SetRenderTarget(gRenderer, layer->texture);
+
+    // Clear the dirty region and clip all drawing to it
+    const int x1 = static_cast<int>(std::floor(region.x));
+    const int y1 = static_cast<int>(std::floor(region.y));
+    const SDL_Rect clip {
+        x1,
+        y1,
+        static_cast<int>(std::ceil(region.w)) - x1,
+        static_cast<int>(std::ceil(region.h)) - y1,
+    };
+    const SDL_FRect clear {
+        static_cast<float>(clip.x),
+        static_cast<float>(clip.y),
+        static_cast<float>(clip.w),
+        static_cast<float>(clip.h),
+    };
+    SDL_SetRenderClipRect(gRenderer, &clip);
+    SDL_SetRenderDrawBlendMode(gRenderer, SDL_BLENDMODE_NONE);
+    SDL_SetRenderDrawColor(gRenderer, 0, 0, 0, 0);
+    SDL_RenderFillRect(gRenderer, &clear);
+    SDL_SetRenderDrawBlendMode(gRenderer, SDL_BLENDMODE_BLEND);
+}
+
+static void end_layer_target()
+{
+    flush_sprite_batch();
+    SDL_SetRenderClipRect(gRenderer, nullptr);
+    SDL_SetRenderTarget(gRenderer, nullptr);
+}
+
+static void run_command(const Frame &frame, const DrawCommand &c)
+{
+    switch (c.kind) {
+    case DrawCommand::QUAD: batch_quad(c.texture, c.dst, c.uv, c.fcolor); return;
+    case DrawCommand::POINTS: batch_points(frame.points.data() + c.points, c.nr_of_points); return;
+    case DrawCommand::RECT:
+        flush_sprite_batch();
+        gRenderCalls++;
+        SDL_SetRenderDrawColor(gRenderer, c.color.r, c.color.g, c.color.b, c.color.a);
+        SDL_RenderRect(gRenderer, &c.dst);
+        return;
+    case DrawCommand::LINE:
+        flush_sprite_batch();
+        gRenderCalls++;
+        SDL_SetRenderDrawColor(gRenderer, c.color.r, c.color.g, c.color.b, c.color.a);
+        SDL_RenderLine(gRenderer, c.dst.x, c.dst.y, c.dst.w, c.dst.h);
+        return;
+    case DrawCommand::TEXT:
+        flush_sprite_batch();
+        gRenderCalls++;
+        SDL_SetRenderDrawColor(gRenderer, c.color.r, c.color.g, c.color.b, c.color.a);
+        SDL_RenderDebugText(gRenderer, c.dst.x, c.dst.y, frame.text.data() + c.text);
+        return;
+    case DrawCommand::LAYER:
+        if (c.layer->texture)
+            batch_quad(c.layer->texture, c.dst, { 0.f, 0.f, 1.f, 1.f }, c.fcolor);
+        return;
+    case DrawCommand::BEGIN_LAYER:
+    case DrawCommand::END_LAYER: return; // Handled by run_layer_commands()
+    }
+}
+
+static void run_layer_commands(const Frame &frame)
+{
+    // Commands for a layer whose texture could not be created are skipped
+    Layer *target = nullptr;
+    for (const DrawCommand &c : frame.layer_commands) {
+        if (c.kind == DrawCommand::BEGIN_LAYER) {
+            target = layer_texture(c.layer) ? c.layer : nullptr;
+            if (target)
+                begin_layer_target(target, c.dst);
+        } else if (c.kind == DrawCommand::END_LAYER) {
+            if (target)
+                end_layer_target();
+            target = nullptr;
+        } else if (target)
+            run_command(frame, c);
+    }
+}
+
+static void sort_draw_keys(std::vector<DrawKey> &keys)
+{
+    // One pass per byte, least significant first. Bytes that are the same for all keys, like
+    // the depth when it is not used, are skipped.
+    const size_t n = keys.size();
+    gSortedKeys.resize(n);
+    for (int shift = 0; shift < 32; shift += 8) {
+        size_t start[257] = {};
+        for (const DrawKey &k : keys)
+            start[((k.key >> shift) & 0xFF) + 1]++;
+        if (start[((keys[0].key >> shift) & 0xFF) + 1] == n)
+            continue;
+
+        for (int i = 0; i < 256; i++)
+            start[i + 1] += start[i];
+        for (const DrawKey &k : keys)
+            gSortedKeys[start[(k.key >> shift) & 0xFF]++] = k;
+        keys.swap(gSortedKeys);
+    }
+}
+
+static void run_frame(Frame &frame)
+{
+    const unsigned long first_render_calls = gRenderCalls;
+
+    run_layer_commands(frame);
+    if (!frame.keys.empty()) {
+        sort_draw_keys(frame.keys);
+        for (const DrawKey &k : frame.keys)
+            run_command(frame, frame.commands[k.command]);
+    }
+    flush_sprite_batch();
+
+    for (Layer *layer : frame.destroyed_layers) {
+        SDL_DestroyTexture(layer->texture);
+        delete layer;
+    }
+
+    frame.commands.clear();
+    frame.keys.clear();
+    frame.layer_commands.clear();
+    frame.text.clear();
+    frame.points.clear();
+    frame.textures.clear();
+    frame.destroyed_layers.clear();
+    frame.draw_calls = gRenderCalls - first_render_calls;
 }
 
 // ----------------------------------------------------------------------------
@@ -204,7 +670,7 @@ bool init()
     std::fill(std::begin(key), std::end(key), 0);
 
     gKeyStates = SDL_GetKeyboardState(nullptr);
-    gLastTicks = SDL_GetTicks();
+    gLastTicks = SDL_GetTicksNS();
 
     // Create multiple audio streams for polyphonic playback (formats are set later)
     for (int i = 0; i < NUM_AUDIO_STREAMS; ++i) {
@@ -224,23 +690,69 @@ bool init()
 }
 
 // ----------------------------------------------------------------------------
-// Present
+// Frames
 // ----------------------------------------------------------------------------
-void present()
+void end_frame()
 {
+    set_draw_order(DL_OVERLAY);
     draw_text(0, 0, rgb(100, 100, 100), "%d fps", fps);
+    profile_draw_overlay();
     fps_counter++;
+    set_draw_order(DL_OBJECTS);
+
+    {
+        // Wait for the main thread to take the last published frame, so the game stays at most
+        // one frame ahead of the screen
+        std::unique_lock<std::mutex> lock(gFrameMutex);
+        gFrameSwapped.wait(lock, [] { return !gFramePublished || gFramesStopped; });
+        std::swap(gRecordingFrame, gPublishedFrame);
+        gFramePublished = true;
+    }
+    gFrameSwapped.notify_all();
+
+    // The frame that came back has been drawn
+    draw_calls += gRecordingFrame->draw_calls;
+    gRecordingFrame->draw_calls = 0;
+
+    // Update delta time, at nanosecond resolution so high frame rates are measured accurately
+    const auto lastTicks = gLastTicks;
+    gLastTicks = SDL_GetTicksNS();
+    const auto deltaTicks = std::min<uint64_t>(gLastTicks - lastTicks, SDL_NS_PER_SECOND);
+    delta_time = static_cast<float>(deltaTicks) / SDL_NS_PER_SECOND;
+}
+
+bool draw_frame(unsigned int timeout_ms)
+{
+    {
+        std::unique_lock<std::mutex> lock(gFrameMutex);
+        if (!gFrameSwapped.wait_for(lock, std::chrono::milliseconds(timeout_ms), [] { return gFramePublished; }))
+            return false;
+        std::swap(gDrawingFrame, gPublishedFrame);
+        gFramePublished = false;
+    }
+    gFrameSwapped.notify_all();
 
+    run_frame(*gDrawingFrame);
     SDL_RenderPresent(gRenderer);
 
     SDL_SetRenderDrawColor(gRenderer, 0, 0, 0, 255);
     SDL_RenderClear(gRenderer);
+    return true;
+}
 
-    // Update delta time
-    const auto lastTicks = gLastTicks;
-    gLastTicks = SDL_GetTicks();
-    const auto deltaTicks = static_cast<int>(gLastTicks - lastTicks);
-    delta_time = clamp(deltaTicks, 0, 1000) / 1000.f;
+void stop_frames()
+{
+    {
+        std::lock_guard<std::mutex> lock(gFrameMutex);
+        gFramesStopped = true;
+    }
+    gFrameSwapped.notify_all();
+}
+
+void present()
+{
+    end_frame();
+    (void)draw_frame(0);
 }
 
 // ----------------------------------------------------------------------------
@@ -251,6 +763,12 @@ bool handle_event(const SDL_Event &e)
     switch (e.type) {
     case SDL_EVENT_QUIT: return true;
 
+    case SDL_EVENT_RENDER_TARGETS_RESET:
+    case SDL_EVENT_RENDER_DEVICE_RESET:
+        // The contents of the layers have been lost, they are redrawn by the game thread
+        gLayersLost = true;
+        return false;
+
     case SDL_EVENT_GAMEPAD_ADDED:
         if (!gGamepad) {
             gGamepad = SDL_OpenGamepad(e.gdevice.which);
@@ -282,6 +800,8 @@ bool handle_event(const SDL_Event &e)
             }
             break;
         }
+        case SDLK_P: profile_toggle_overlay(); break;
+        case SDLK_T: profile_toggle_trace("trace.json"); break;
         case SDLK_1: SDL_SetWindowSize(gWindow, SCREEN_W, SCREEN_H); break;
         case SDLK_2: SDL_SetWindowSize(gWindow, SCREEN_W * 2, SCREEN_H * 2); break;
         case SDLK_3: SDL_SetWindowSize(gWindow, SCREEN_W * 3, SCREEN_H * 3); break;
@@ -294,21 +814,7 @@ bool handle_event(const SDL_Event &e)
     }
 }
 
-void update_input_state()
-{
-    key[KEY_QUIT] = gKeyStates[SDL_SCANCODE_ESCAPE];
-    key[KEY_LEFT] = gKeyStates[SDL_SCANCODE_LEFT];
-    key[KEY_RIGHT] = gKeyStates[SDL_SCANCODE_RIGHT];
-    key[KEY_ACTION] = gKeyStates[SDL_SCANCODE_SPACE];
-
-    if (gGamepad) {
-        key[KEY_ACTION] |= SDL_GetGamepadButton(gGamepad, SDL_GAMEPAD_BUTTON_SOUTH);
-        key[KEY_LEFT] |= SDL_GetGamepadButton(gGamepad, SDL_GAMEPAD_BUTTON_DPAD_LEFT);
-        key[KEY_RIGHT] |= SDL_GetGamepadButton(gGamepad, SDL_GAMEPAD_BUTTON_DPAD_RIGHT);
-    }
-}
-
-float get_gamepad_left_x()
+static float read_gamepad_left_x()
 {
     if (!gGamepad) {
         return 0.f;
@@ -321,13 +827,52 @@ float get_gamepad_left_x()
     return (abs(axisF) <= deadzone) ? 0.f : axisF;
 }
 
-void rumble_gamepad(Uint16 low_frequency_rumble, Uint16 high_frequency_rumble, Uint32 duration_ms)
+void sample_input()
 {
-    if (!gGamepad) {
+    uint8_t keys = 0;
+    keys |= gKeyStates[SDL_SCANCODE_ESCAPE] << KEY_QUIT;
+    keys |= gKeyStates[SDL_SCANCODE_LEFT] << KEY_LEFT;
+    keys |= gKeyStates[SDL_SCANCODE_RIGHT] << KEY_RIGHT;
+    keys |= gKeyStates[SDL_SCANCODE_SPACE] << KEY_ACTION;
+
+    if (gGamepad) {
+        keys |= SDL_GetGamepadButton(gGamepad, SDL_GAMEPAD_BUTTON_SOUTH) << KEY_ACTION;
+        keys |= SDL_GetGamepadButton(gGamepad, SDL_GAMEPAD_BUTTON_DPAD_LEFT) << KEY_LEFT;
+        keys |= SDL_GetGamepadButton(gGamepad, SDL_GAMEPAD_BUTTON_DPAD_RIGHT) << KEY_RIGHT;
+    }
+    gSampledKeys = keys;
+    gSampledLeftX = read_gamepad_left_x();
+
+    const uint64_t rumble = gRumbleRequest.exchange(0);
+    if (rumble && gGamepad)
+        SDL_RumbleGamepad(gGamepad, rumble >> 48, (rumble >> 32) & 0xFFFF, rumble & 0xFFFFFFFF);
+}
+
+void update_input_state()
+{
+    if (is_playing()) {
+        play_input(gGamepadLeftX);
         return;
     }
 
-    SDL_RumbleGamepad(gGamepad, low_frequency_rumble, high_frequency_rumble, duration_ms);
+    const uint8_t keys = gSampledKeys;
+    for (int k : { KEY_QUIT, KEY_LEFT, KEY_RIGHT, KEY_ACTION })
+        key[k] = (keys >> k) & 1;
+    gGamepadLeftX = gSampledLeftX;
+
+    record_input(gGamepadLeftX);
+}
+
+float get_gamepad_left_x()
+{
+    return gGamepadLeftX;
+}
+
+void rumble_gamepad(Uint16 low_frequency_rumble, Uint16 high_frequency_rumble, Uint32 duration_ms)
+{
+    // Started by the main thread, which owns the gamepad
+    gRumbleRequest = static_cast<uint64_t>(low_frequency_rumble) << 48 |
+                     static_cast<uint64_t>(high_frequency_rumble) << 32 | duration_ms;
 }
 
 // ----------------------------------------------------------------------------
@@ -354,6 +899,23 @@ void shutdown()
         gGamepad = nullptr;
     }
 
+    for (auto &pending : gPendingSprites)
+        SDL_DestroySurface(pending.surface);
+    gPendingSprites.clear();
+
+    for (auto *texture : gAtlasTextures)
+        SDL_DestroyTexture(texture);
+    gAtlasTextures.clear();
+
+    // Layers destroyed in frames that were never drawn
+    for (Frame &frame : gFrames) {
+        for (Layer *layer : frame.destroyed_layers) {
+            SDL_DestroyTexture(layer->texture);
+            delete layer;
+        }
+        frame.destroyed_layers.clear();
+    }
+
     if (gRenderer) {
         SDL_DestroyRenderer(gRenderer);
         gRenderer = nullptr;
@@ -405,11 +967,83 @@ Sprite *load_sprite(const char *filename)
         }
     }
 
-    auto *sprite = SDL_CreateTextureFromSurface(gRenderer, surf);
-    if (!sprite)
-        print_error("Warning: Failed to create texture from surface (%s)", SDL_GetError());
-
-    SDL_DestroySurface(surf);
+    // The sprite gets its texture when build_atlas() is called
+    auto *sprite = new Sprite;
+    sprite->w = surf->w;
+    sprite->h = surf->h;
+    gPendingSprites.push_back({ sprite, surf });
 
     return sprite;
 }
+
+bool build_atlas()
+{
+    if (gPendingSprites.empty())
+        return true;
+
+    // Shelf packing, tallest sprites first. A pixel of padding around each sprite keeps
+    // neighbours from bleeding in when the sprites are scaled.
+    constexpr int padding = 1;
+    std::vector<PendingSprite> pending = std::move(gPendingSprites);
+    gPendingSprites.clear();
+    std::stable_sort(pending.begin(), pending.end(), [](const PendingSprite &a, const PendingSprite &b) {
+        return a.sprite->h > b.sprite->h;
+    });
+
+    int atlas_w = 1024;
+    for (const auto &p : pending)
+        atlas_w = max(atlas_w, p.sprite->w + 2 * padding);
+
+    std::vector<SDL_Rect> places;
+    places.reserve(pending.size());
+    int shelf_x = 0, shelf_y = 0, shelf_h = 0;
+    for (const auto &p : pending) {
+        const int w = p.sprite->w + 2 * padding;
+        const int h = p.sprite->h + 2 * padding;
+        if (shelf_x + w > atlas_w) {
+            shelf_y += shelf_h;
+            shelf_x = 0;
+            shelf_h = 0;
+        }
+        places.push_back({ shelf_x + padding, shelf_y + padding, p.sprite->w, p.sprite->h });
+        shelf_x += w;
+        shelf_h = max(shelf_h, h);
+    }
+    const int atlas_h = shelf_y + shelf_h;
+
+    // Blitting without blending bakes the color key into the alpha channel
+    SDL_Surface *atlas = SDL_CreateSurface(atlas_w, atlas_h, SDL_PIXELFORMAT_RGBA32);
+    if (!atlas) {
+        print_error("Warning: Failed to create atlas surface (%s)", SDL_GetError());
+    } else {
+        SDL_FillSurfaceRect(atlas, nullptr, 0);
+        for (size_t i = 0; i < pending.size(); i++) {
+            SDL_SetSurfaceBlendMode(pending[i].surface, SDL_BLENDMODE_NONE);
+            if (!SDL_BlitSurface(pending[i].surface, nullptr, atlas, &places[i]))
+                print_error("Warning: Failed to blit sprite into atlas (%s)", SDL_GetError());
+        }
+    }
+
+    SDL_Texture *texture = atlas ? SDL_CreateTextureFromSurface(gRenderer, atlas) : nullptr;
+    if (!texture) {
+        print_error("Warning: Failed to create atlas texture (%s)", SDL_GetError());
+    } else {
+        SDL_SetTextureBlendMode(texture, SDL_BLENDMODE_BLEND);
+        gAtlasTextures.push_back(texture);
+    }
+
+    for (size_t i = 0; i < pending.size(); i++) {
+        Sprite *sprite = pending[i].sprite;
+        sprite->texture = texture;
+        sprite->uv = {
+            static_cast<float>(places[i].x) / atlas_w,
+            static_cast<float>(places[i].y) / atlas_h,
+            static_cast<float>(places[i].w) / atlas_w,
+            static_cast<float>(places[i].h) / atlas_h,
+        };
+        SDL_DestroySurface(pending[i].surface);
+    }
+    SDL_DestroySurface(atlas);
+
+    return texture != nullptr;
+}
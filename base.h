@@ -8,6 +8,7 @@
 
 #include <algorithm>
 #include <cmath>
+#include <cstddef>
 #include <cstdint>
 
 #include <SDL3/SDL.h>
@@ -49,7 +50,13 @@ inline constexpr int SCREEN_H = 480;
  */
 
 using Color = SDL_Color;
-using Sprite = SDL_Texture;
+
+/** A sprite is a region of the texture atlas */
+struct Sprite {
+    SDL_Texture *texture = nullptr;
+    SDL_FRect uv {}; // Region in texture coordinates
+    int w = 0, h = 0;
+};
 
 /** Raw audio buffer and metadata */
 struct Sample {
@@ -73,20 +80,56 @@ struct Sample {
 /** Print error message to stderr */
 void print_error(const char *fmt, ...);
 
+/* Number of render calls issued, for profiling */
+extern unsigned long draw_calls;
+
 /* Drawing functions  */
 void draw_text(float x, float y, Color color, const char *fmt, ...);
 void draw_rect(float x1, float y1, float x2, float y2, Color color);
 void draw_line(float x1, float y1, float x2, float y2, Color color);
 void draw_point(float x, float y, Color color);
+void draw_points(size_t n, const float *x, const float *y, const float *alpha, Color color);
 void draw_sprite(Sprite *spr, float x, float y, float alpha = 1.0f);
 
+/* Draw order: the drawing functions are recorded with the draw layer and depth set last, and
+   present() draws them sorted on layer, then texture, then depth, so runs of sprites sharing a
+   texture are drawn together. Draws with the same layer, texture and depth keep the order they
+   were made in. Drawing into a layer between begin_layer() and end_layer() is not recorded. */
+enum DrawLayer : uint8_t {
+    DL_BACKGROUND, // Stars
+    DL_STATIC, // Cached border and bricks
+    DL_BRICKS, // Bricks that are changing
+    DL_OBJECTS, // Balls and pad, the default
+    DL_HUD, // Score and level
+    DL_OVERLAY // Frame rate and profiler
+};
+void set_draw_order(DrawLayer layer, uint16_t depth = 0);
+
+/* Layers: cached render targets, only redrawn where they have been invalidated */
+struct Layer;
+[[nodiscard]] Layer *create_layer();
+void destroy_layer(Layer *layer);
+void invalidate_layer(Layer *layer);
+void invalidate_layer(Layer *layer, float x1, float y1, float x2, float y2);
+[[nodiscard]] bool begin_layer(Layer *layer); // When true, redraw the layer and call end_layer
+void end_layer(Layer *layer);
+void draw_layer(Layer *layer);
+
 /* Audio */
 void play_sample(Sample *s, float gain = 1.f, int pan = 128, float frequencyRatio = 1.f, int loop = 0);
 
-/* Main loop */
+/* Main loop. The game can run on its own thread: it calls update_input_state(), draws and
+   publishes each frame with end_frame(), while the main thread handles the events, calls
+   sample_input() and shows the published frames with draw_frame(). end_frame() waits until
+   the previous frame has been taken, so the game runs at most one frame ahead. On a single
+   thread, call sample_input(), update_input_state(), draw and present(). */
 [[nodiscard]] bool init();
-void present();
+void end_frame(); // Game thread
+[[nodiscard]] bool draw_frame(unsigned int timeout_ms); // Main thread, false when no frame came
+void stop_frames(); // Lets end_frame() return without waiting, when the game thread is stopped
+void present(); // end_frame() and draw_frame()
 [[nodiscard]] bool handle_event(const SDL_Event &event);
+void sample_input(); // Main thread
 void update_input_state();
 [[nodiscard]] float get_gamepad_left_x();
 void rumble_gamepad(Uint16 low_frequency_rumble, Uint16 high_frequency_rumble, Uint32 duration_ms);
@@ -95,3 +138,4 @@ void shutdown();
 /* Resources */
 [[nodiscard]] Sample *load_sample(const char *filename);
 [[nodiscard]] Sprite *load_sprite(const char *filename);
+[[nodiscard]] bool build_atlas();
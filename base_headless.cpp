@@ -0,0 +1,207 @@
+/*
+ * base_headless.cpp
+ *
+ * Implementation of the basic functions without a window, renderer or audio device. Used by
+ * the benchmark to run the game at full speed on machines without a display.
+ */
+
+#include "base.h"
+#include "replay.h"
+
+#include <algorithm>
+#include <iterator>
+
+// ----------------------------------------------------------------------------
+// Global variables (declared extern in header)
+// ----------------------------------------------------------------------------
+volatile unsigned char key[256] = { 0 };
+volatile float delta_time = 0.f;
+
+// Without a renderer, each draw_* call is counted as a render call.
+unsigned long draw_calls = 0;
+
+// ----------------------------------------------------------------------------
+// Utility
+// ----------------------------------------------------------------------------
+void print_error(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    fputc('\n', stderr);
+    va_end(ap);
+}
+
+// ----------------------------------------------------------------------------
+// Drawing functions
+// ----------------------------------------------------------------------------
+void draw_text(float x, float y, Color color, const char *fmt, ...)
+{
+    draw_calls++;
+}
+
+void draw_rect(float x1, float y1, float x2, float y2, Color color)
+{
+    draw_calls++;
+}
+
+void draw_line(float x1, float y1, float x2, float y2, Color color)
+{
+    draw_calls++;
+}
+
+void draw_point(float x, float y, Color color)
+{
+    draw_calls++;
+}
+
+void draw_points(size_t n, const float *x, const float *y, const float *alpha, Color color)
+{
+    draw_calls++;
+}
+
+void draw_sprite(Sprite *spr, float x, float y, float alpha)
+{
+    draw_calls++;
+}
+
+void set_draw_order(DrawLayer layer, uint16_t depth)
+{
+}
+
+// ----------------------------------------------------------------------------
+// Layers
+// ----------------------------------------------------------------------------
+struct Layer {
+    bool dirty = true;
+};
+
+Layer *create_layer()
+{
+    return new Layer;
+}
+
+void destroy_layer(Layer *layer)
+{
+    delete layer;
+}
+
+void invalidate_layer(Layer *layer)
+{
+    layer->dirty = true;
+}
+
+void invalidate_layer(Layer *layer, float x1, float y1, float x2, float y2)
+{
+    layer->dirty = true;
+}
+
+bool begin_layer(Layer *layer)
+{
+    return layer->dirty;
+}
+
+void end_layer(Layer *layer)
+{
+    layer->dirty = false;
+}
+
+void draw_layer(Layer *layer)
+{
+    draw_calls++;
+}
+
+// ----------------------------------------------------------------------------
+// Audio playback
+// ----------------------------------------------------------------------------
+void play_sample(Sample *s, float gain, int pan, float frequencyRatio, int loop)
+{
+}
+
+// ----------------------------------------------------------------------------
+// Main loop
+// ----------------------------------------------------------------------------
+bool init()
+{
+    std::fill(std::begin(key), std::end(key), 0);
+    return true;
+}
+
+void end_frame()
+{
+}
+
+bool draw_frame(unsigned int timeout_ms)
+{
+    return true;
+}
+
+void stop_frames()
+{
+}
+
+void present()
+{
+}
+
+bool handle_event(const SDL_Event &e)
+{
+    return false;
+}
+
+static float gGamepadLeftX = 0.f;
+
+void sample_input()
+{
+}
+
+void update_input_state()
+{
+    // Without a keyboard, input can only come from a recording
+    if (is_playing())
+        play_input(gGamepadLeftX);
+}
+
+float get_gamepad_left_x()
+{
+    return gGamepadLeftX;
+}
+
+void rumble_gamepad(Uint16 low_frequency_rumble, Uint16 high_frequency_rumble, Uint32 duration_ms)
+{
+}
+
+void shutdown()
+{
+}
+
+// ----------------------------------------------------------------------------
+// Resources
+// ----------------------------------------------------------------------------
+Sample *load_sample(const char *filename)
+{
+    return nullptr;
+}
+
+Sprite *load_sprite(const char *filename)
+{
+    // Only the dimensions of the sprite are needed, the pixels are never drawn.
+    SDL_Surface *surf = SDL_LoadBMP(filename);
+    if (!surf) {
+        print_error("Failed loading BMP: %s (%s)", filename, SDL_GetError());
+        return nullptr;
+    }
+
+    auto *sprite = new Sprite {};
+    sprite->w = surf->w;
+    sprite->h = surf->h;
+
+    SDL_DestroySurface(surf);
+
+    return sprite;
+}
+
+bool build_atlas()
+{
+    return true;
+}
@@ -0,0 +1,213 @@
+/**********************************************************************************************
+ *  Breakout benchmark - runs the game without a display at a fixed time step
+ *
+ *  Usage: breakout_bench [frames] [fps] [seed] [threads] [debris]
+ *         breakout_bench --play <file> [threads] [debris]
+ *
+ *  Input is scripted: the pad sweeps left and right and the ball is released every two
+ *  seconds. The player never runs out of balls, so all levels keep being played.
+ *  With --play, the input, time steps and seed of a recording made with "breakout --record"
+ *  are used instead, and every recorded frame is measured, simulated at the rate it was
+ *  recorded with.
+ *  threads is the number of worker threads of the particle system, 0 for all cores.
+ *  The game alone has too few particles to be split over the threads, so debris particles
+ *  (2048 by default) fall and bounce around in a system of their own next to it.
+ *  Run from the project root, so the levels in data/ can be found.
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "base.h"
+#include "box_overlap.h"
+#include "data.h"
+#include "p_engine.h"
+#include "ptypes.h"
+#include "replay.h"
+
+//=====   Debris   ==========================================================================//
+
+class Debris : public Particle {
+public:
+    Debris(float ix, float iy, float idx, float idy)
+    {
+        x = ix;
+        y = iy;
+        dx = idx;
+        dy = idy;
+        w = h = 2.f;
+        gravity = 1.f;
+        affected_by_obstacle = true;
+        parallel_update = true;
+    }
+};
+
+// Owns the debris system, which uses the threads of the system it is added to. It has its
+// own random numbers, so recordings still play back the same.
+class DebrisField : public Particle {
+public:
+    explicit DebrisField(int inr_of_debris)
+        : nr_of_debris(inr_of_debris)
+    {
+    }
+
+    void initialize() override
+    {
+        debris.share_worker_threads(*system);
+        debris.add_particle<Block>(-10.f, -10.f, 0.f, SCREEN_H + 10.f);
+        debris.add_particle<Block>(SCREEN_W, -10.f, SCREEN_W + 10.f, SCREEN_H + 10.f);
+        debris.add_particle<Block>(0.f, -10.f, SCREEN_W, 0.f);
+        debris.add_particle<Block>(0.f, SCREEN_H, SCREEN_W, SCREEN_H + 10.f);
+
+        Particle *pull = debris.add_particle<Particle>();
+        pull->gy = 200.f;
+        pull->set_gravity_type(GravityType::Constant);
+
+        for (int i = 0; i < nr_of_debris; i++) {
+            Random &random = debris.random;
+            const float x = 10.f + random.randf() * (SCREEN_W - 20.f);
+            const float y = 10.f + random.randf() * (SCREEN_H - 20.f);
+            debris.add_particle<Debris>(x, y, random.randf() * 200.f - 100.f, random.randf() * 200.f - 100.f);
+        }
+    }
+
+    void update(float dt) override { debris.update_particles(dt); }
+    void draw() override { debris.draw_particles(system->interpolation()); }
+    void remove() override { debris.remove_particles(); }
+
+private:
+    Particle_System_T<SF_ALL> debris;
+    int nr_of_debris = 0;
+};
+
+//=====   Benchmark   =======================================================================//
+
+static void script_input(int frame, int fps)
+{
+    const int sweep = (frame / fps) % 2; // Change direction every second
+
+    key[KEY_LEFT] = sweep == 0;
+    key[KEY_RIGHT] = sweep == 1;
+    key[KEY_ACTION] = (frame % (2 * fps)) == 0;
+}
+
+int main(int argc, char *argv[])
+{
+    const bool play = argc > 2 && std::strcmp(argv[1], "--play") == 0;
+    int frames = !play && argc > 1 ? std::atoi(argv[1]) : 3000;
+    const int fps = !play && argc > 2 ? std::atoi(argv[2]) : 60;
+    uint64_t seed = !play && argc > 3 ? std::atoi(argv[3]) : 1;
+    const int threads = std::atoi(play ? (argc > 3 ? argv[3] : "1") : (argc > 4 ? argv[4] : "1"));
+    const int nr_of_debris = std::atoi(play ? (argc > 4 ? argv[4] : "2048") : (argc > 5 ? argv[5] : "2048"));
+    const int warm_up_frames = play ? 0 : fps;
+
+    if (frames <= 0 || fps <= 0 || threads < 0 || nr_of_debris < 0) {
+        print_error("Usage: %s [frames] [fps] [seed] [threads] [debris]\n       %s --play <file> [threads] [debris]",
+                    argv[0],
+                    argv[0]);
+        return EXIT_FAILURE;
+    }
+    float rate = 60.f;
+    if (play && !start_playback(argv[2], seed, rate))
+        return EXIT_FAILURE;
+
+    if (!init())
+        return EXIT_FAILURE;
+
+    load_data();
+    if (!data.BRICK01_BMP || !data.PAD01_BMP || !data.BALL01_BMP) {
+        print_error("Critical assets failed to load, run from the project root.");
+        return EXIT_FAILURE;
+    }
+
+    delta_time = 1.f / fps;
+
+    Particle_System_T<SF_NONE> p;
+    p.set_worker_threads(threads);
+    p.random.seed(seed);
+    Fixed_Timestep timestep(rate);
+    auto *game = p.add_particle<BreakoutGame>();
+    p.add_particle<StarField>();
+    if (nr_of_debris > 0)
+        p.add_particle<DebrisField>(nr_of_debris);
+
+    using Clock = std::chrono::steady_clock;
+    Clock::duration update_time {};
+    Clock::duration draw_time {};
+    Particle_Counters counters;
+    Pool_Stats pool_stats;
+    unsigned long first_draw_calls = 0;
+
+    if (play)
+        frames = 0;
+
+    for (int frame = 0; play || frame < warm_up_frames + frames; frame++) {
+        if (frame == warm_up_frames) {
+            counters = particle_counters;
+            pool_stats = Particle_Pool::total_stats();
+            first_draw_calls = draw_calls;
+        }
+
+        if (play) {
+            update_input_state();
+            if (key[KEY_QUIT])
+                break;
+            frames++;
+        } else {
+            script_input(frame, fps);
+            game->balls_left = 3;
+        }
+
+        const auto start = Clock::now();
+        float alpha = 1.f;
+        if (play)
+            alpha = timestep.advance(p, delta_time);
+        else
+            p.update_particles(delta_time);
+        const auto updated = Clock::now();
+        p.draw_particles(alpha);
+        const auto drawn = Clock::now();
+
+        if (frame >= warm_up_frames) {
+            update_time += updated - start;
+            draw_time += drawn - updated;
+        }
+    }
+
+    const double update_ns = std::chrono::duration<double, std::nano>(update_time).count();
+    const double draw_ns = std::chrono::duration<double, std::nano>(draw_time).count();
+    const double particles = particle_counters.particles_updated - counters.particles_updated;
+    const double collision_tests = particle_counters.collision_tests - counters.collision_tests;
+
+    if (frames == 0) {
+        print_error("No frames were played.");
+        return EXIT_FAILURE;
+    }
+
+    if (play)
+        std::printf("frames:            %d from %s at %g Hz (seed %llu)\n",
+                    frames,
+                    argv[2],
+                    rate,
+                    (unsigned long long)seed);
+    else
+        std::printf("frames:            %d at %d fps (seed %llu)\n", frames, fps, (unsigned long long)seed);
+    std::printf("worker threads:    %d (%d debris)\n", threads, nr_of_debris);
+    std::printf("narrow phase:      %s\n", box_overlap_isa());
+    std::printf("update_particles:  %.0f ns/frame\n", update_ns / frames);
+    std::printf("per particle:      %.1f ns (%.1f particles/frame)\n", update_ns / particles, particles / frames);
+    std::printf("collision tests:   %.1f /frame\n", collision_tests / frames);
+    std::printf("draw_particles:    %.0f ns/call (%.1f draw calls/frame)\n",
+                draw_ns / frames,
+                static_cast<double>(draw_calls - first_draw_calls) / frames);
+    std::printf("heap allocations:  %lu from particle pools\n",
+                Particle_Pool::total_stats().heap_allocations - pool_stats.heap_allocations);
+
+    stop_replay();
+    p.remove_particles();
+    shutdown();
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,134 @@
+/*
+ * box_overlap.cpp
+ *
+ * Implementations of the box test for each instruction set, and the choice between them.
+ */
+
+#include "box_overlap.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define BOX_OVERLAP_X86 1
+#include <immintrin.h>
+#endif
+
+using Find_Function = size_t (*)(const Box_Bounds &, size_t, float, float, float, float, uint32_t *);
+
+static size_t find_scalar(const Box_Bounds &b, size_t n, float x1, float y1, float x2, float y2, uint32_t *hits)
+{
+    size_t count = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (b.x2[i] > x1 && b.y2[i] > y1 && b.x1[i] < x2 && b.y1[i] < y2)
+            hits[count++] = static_cast<uint32_t>(i);
+    }
+    return count;
+}
+
+#ifdef BOX_OVERLAP_X86
+
+// Appends the lanes set in mask, counting from the box at index i
+static inline size_t add_hits(unsigned int mask, size_t i, uint32_t *hits, size_t count)
+{
+    while (mask) {
+        hits[count++] = static_cast<uint32_t>(i + __builtin_ctz(mask));
+        mask &= mask - 1;
+    }
+    return count;
+}
+
+__attribute__((target("sse2"))) static size_t
+find_sse(const Box_Bounds &b, size_t n, float x1, float y1, float x2, float y2, uint32_t *hits)
+{
+    const __m128 qx1 = _mm_set1_ps(x1), qy1 = _mm_set1_ps(y1);
+    const __m128 qx2 = _mm_set1_ps(x2), qy2 = _mm_set1_ps(y2);
+
+    size_t count = 0, i = 0;
+    for (; i + 4 <= n; i += 4) {
+        const __m128 in_x =
+            _mm_and_ps(_mm_cmpgt_ps(_mm_loadu_ps(b.x2 + i), qx1), _mm_cmplt_ps(_mm_loadu_ps(b.x1 + i), qx2));
+        const __m128 in_y =
+            _mm_and_ps(_mm_cmpgt_ps(_mm_loadu_ps(b.y2 + i), qy1), _mm_cmplt_ps(_mm_loadu_ps(b.y1 + i), qy2));
+        count = add_hits(_mm_movemask_ps(_mm_and_ps(in_x, in_y)), i, hits, count);
+    }
+    for (; i < n; i++) {
+        if (b.x2[i] > x1 && b.y2[i] > y1 && b.x1[i] < x2 && b.y1[i] < y2)
+            hits[count++] = static_cast<uint32_t>(i);
+    }
+    return count;
+}
+
+__attribute__((target("avx2"))) static size_t
+find_avx2(const Box_Bounds &b, size_t n, float x1, float y1, float x2, float y2, uint32_t *hits)
+{
+    const __m256 qx1 = _mm256_set1_ps(x1), qy1 = _mm256_set1_ps(y1);
+    const __m256 qx2 = _mm256_set1_ps(x2), qy2 = _mm256_set1_ps(y2);
+
+    size_t count = 0, i = 0;
+    for (; i + 8 <= n; i += 8) {
+        const __m256 in_x = _mm256_and_ps(_mm256_cmp_ps(_mm256_loadu_ps(b.x2 + i), qx1, _CMP_GT_OQ),
+                                          _mm256_cmp_ps(_mm256_loadu_ps(b.x1 + i), qx2, _CMP_LT_OQ));
+        const __m256 in_y = _mm256_and_ps(_mm256_cmp_ps(_mm256_loadu_ps(b.y2 + i), qy1, _CMP_GT_OQ),
+                                          _mm256_cmp_ps(_mm256_loadu_ps(b.y1 + i), qy2, _CMP_LT_OQ));
+        count = add_hits(_mm256_movemask_ps(_mm256_and_ps(in_x, in_y)), i, hits, count);
+    }
+    for (; i < n; i++) {
+        if (b.x2[i] > x1 && b.y2[i] > y1 && b.x1[i] < x2 && b.y1[i] < y2)
+            hits[count++] = static_cast<uint32_t>(i);
+    }
+    return count;
+}
+
+__attribute__((target("avx512f"))) static size_t
+find_avx512(const Box_Bounds &b, size_t n, float x1, float y1, float x2, float y2, uint32_t *hits)
+{
+    const __m512 qx1 = _mm512_set1_ps(x1), qy1 = _mm512_set1_ps(y1);
+    const __m512 qx2 = _mm512_set1_ps(x2), qy2 = _mm512_set1_ps(y2);
+
+    // The last boxes are loaded with a mask, so there is no scalar tail
+    size_t count = 0;
+    for (size_t i = 0; i < n; i += 16) {
+        const __mmask16 lanes = n - i >= 16 ? 0xFFFF : static_cast<__mmask16>((1u << (n - i)) - 1);
+        __mmask16 mask = _mm512_mask_cmp_ps_mask(lanes, _mm512_maskz_loadu_ps(lanes, b.x2 + i), qx1, _CMP_GT_OQ);
+        mask = _mm512_mask_cmp_ps_mask(mask, _mm512_maskz_loadu_ps(lanes, b.y2 + i), qy1, _CMP_GT_OQ);
+        mask = _mm512_mask_cmp_ps_mask(mask, _mm512_maskz_loadu_ps(lanes, b.x1 + i), qx2, _CMP_LT_OQ);
+        mask = _mm512_mask_cmp_ps_mask(mask, _mm512_maskz_loadu_ps(lanes, b.y1 + i), qy2, _CMP_LT_OQ);
+        count = add_hits(mask, i, hits, count);
+    }
+    return count;
+}
+
+#endif
+
+struct Box_Overlap_Implementation {
+    Find_Function find;
+    const char *isa;
+};
+
+static Box_Overlap_Implementation choose_implementation()
+{
+#ifdef BOX_OVERLAP_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        return {find_avx512, "AVX-512"};
+    if (__builtin_cpu_supports("avx2"))
+        return {find_avx2, "AVX2"};
+    if (__builtin_cpu_supports("sse2"))
+        return {find_sse, "SSE2"};
+#endif
+    return {find_scalar, "scalar"};
+}
+
+static const Box_Overlap_Implementation &implementation()
+{
+    static const Box_Overlap_Implementation chosen = choose_implementation();
+    return chosen;
+}
+
+size_t find_overlapping_boxes(const Box_Bounds &boxes, size_t n, float x1, float y1, float x2, float y2, uint32_t *hits)
+{
+    return implementation().find(boxes, n, x1, y1, x2, y2, hits);
+}
+
+const char *box_overlap_isa()
+{
+    return implementation().isa;
+}
@@ -0,0 +1,27 @@
+/*
+ * box_overlap.h
+ *
+ * Tests many axis-aligned boxes against one box at once. The boxes are stored as one array per
+ * bound, so the test runs on 16, 8 or 4 boxes at a time with AVX-512, AVX2 or SSE. The widest
+ * instruction set the CPU supports is chosen at run time; other CPUs use plain C++.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Bounds of a number of boxes, one array per bound.
+struct Box_Bounds {
+    const float *x1, *y1, *x2, *y2;
+};
+
+/*
+  Writes the index of each box that overlaps the box x1, y1 - x2, y2 by more than just touching
+  it to hits, in increasing order, and returns the number of hits. hits must have room for n.
+*/
+size_t find_overlapping_boxes(
+    const Box_Bounds &boxes, size_t n, float x1, float y1, float x2, float y2, uint32_t *hits);
+
+// Name of the instruction set used by find_overlapping_boxes().
+const char *box_overlap_isa();
@@ -0,0 +1,43 @@
+/*
+ * data.cpp
+ *
+ * Loads the sprites and samples used by this game.
+ */
+
+#include "data.h"
+
+Data data;
+
+/* Datafile */
+void load_data()
+{
+    data.BALL01_BMP = load_sprite("data/ball01.bmp");
+    data.BLIP1_WAV = load_sample("data/BLIP1.wav");
+    data.BONUS01_BMP = load_sprite("data/bonus01.bmp");
+    data.BORDER_BMP = load_sprite("data/border.bmp");
+    data.BRICK01_BMP = load_sprite("data/brick01.bmp");
+    data.BRICK02_BMP = load_sprite("data/brick02.bmp");
+    data.BRICK03_BMP = load_sprite("data/brick03.bmp");
+    data.BRICK03B_BMP = load_sprite("data/brick03b.bmp");
+    data.BRICK04_BMP = load_sprite("data/brick04.bmp");
+    data.BRICK05_BMP = load_sprite("data/brick05.bmp");
+    data.BRICK06_BMP = load_sprite("data/brick06.bmp");
+    data.BRICK07_BMP = load_sprite("data/brick07.bmp");
+    data.BRICK08_BMP = load_sprite("data/brick08.bmp");
+    data.BRICK09_BMP = load_sprite("data/brick09.bmp");
+    data.BRICK10_BMP = load_sprite("data/brick10.bmp");
+    data.COIN_BMP = load_sprite("data/coin.bmp");
+    data.HIT3_WAV = load_sample("data/HIT3.wav");
+    data.PAD01_BMP = load_sprite("data/pad01.bmp");
+    data.POP1_WAV = load_sample("data/POP1.wav");
+    data.POP2_WAV = load_sample("data/POP2.wav");
+    data.POP3_WAV = load_sample("data/POP3.wav");
+    data.POP4_WAV = load_sample("data/POP4.wav");
+    data.POP5_WAV = load_sample("data/POP5.wav");
+    data.STARTUP_WAV = load_sample("data/STARTUP.wav");
+    data.TIN_WAV = load_sample("data/TIN.wav");
+
+    // Pack all sprites into one texture
+    if (!build_atlas())
+        print_error("Warning: Failed to build the sprite atlas");
+}
@@ -1,3 +1,5 @@
+#pragma once
+
 #include "base.h"
 
 struct Data {
@@ -27,3 +29,8 @@ struct Data {
     Sample *STARTUP_WAV = nullptr;
     Sample *TIN_WAV = nullptr;
 };
+
+extern Data data;
+
+/* Loads all sprites and samples from the data directory */
+void load_data();
@@ -8,8 +8,11 @@
 
 #define SDL_MAIN_USE_CALLBACKS
 
+#include <atomic>
 #include <cstdlib>
+#include <cstring>
 #include <ctime>
+#include <thread>
 
 #include <SDL3/SDL_main.h>
 
@@ -20,45 +23,58 @@
 #include "base.h"
 #include "data.h"
 #include "p_engine.h"
+#include "profiler.h"
 #include "ptypes.h"
+#include "replay.h"
 
 //=====   Main program   ====================================================================//
 
 // Global variables
-Particle_System p;
-Data data;
+Particle_System_T<SF_NONE> p;
+Fixed_Timestep timestep;
 
-/* Datafile */
-void load_data()
+#ifndef __EMSCRIPTEN__
+// The game runs on its own thread, so drawing and waiting for vsync on the main thread
+// overlaps with the next frame of the game
+std::thread game_thread;
+std::atomic<bool> game_running { false };
+#endif
+
+// Reads the input, advances the particles and publishes their draws
+static void run_frame()
 {
-    data.BALL01_BMP = load_sprite("data/ball01.bmp");
-    data.BLIP1_WAV = load_sample("data/BLIP1.wav");
-    data.BONUS01_BMP = load_sprite("data/bonus01.bmp");
-    data.BORDER_BMP = load_sprite("data/border.bmp");
-    data.BRICK01_BMP = load_sprite("data/brick01.bmp");
-    data.BRICK02_BMP = load_sprite("data/brick02.bmp");
-    data.BRICK03_BMP = load_sprite("data/brick03.bmp");
-    data.BRICK03B_BMP = load_sprite("data/brick03b.bmp");
-    data.BRICK04_BMP = load_sprite("data/brick04.bmp");
-    data.BRICK05_BMP = load_sprite("data/brick05.bmp");
-    data.BRICK06_BMP = load_sprite("data/brick06.bmp");
-    data.BRICK07_BMP = load_sprite("data/brick07.bmp");
-    data.BRICK08_BMP = load_sprite("data/brick08.bmp");
-    data.BRICK09_BMP = load_sprite("data/brick09.bmp");
-    data.BRICK10_BMP = load_sprite("data/brick10.bmp");
-    data.COIN_BMP = load_sprite("data/coin.bmp");
-    data.HIT3_WAV = load_sample("data/HIT3.wav");
-    data.PAD01_BMP = load_sprite("data/pad01.bmp");
-    data.POP1_WAV = load_sample("data/POP1.wav");
-    data.POP2_WAV = load_sample("data/POP2.wav");
-    data.POP3_WAV = load_sample("data/POP3.wav");
-    data.POP4_WAV = load_sample("data/POP4.wav");
-    data.POP5_WAV = load_sample("data/POP5.wav");
-    data.STARTUP_WAV = load_sample("data/STARTUP.wav");
-    data.TIN_WAV = load_sample("data/TIN.wav");
+    profile_begin_frame();
+    {
+        PROFILE_ZONE("update_input_state");
+        update_input_state();
+    }
+    float alpha;
+    {
+        PROFILE_ZONE_COUNT("update_particles", particle_counters.particles_updated);
+        alpha = timestep.advance(p, delta_time);
+    }
+    {
+        PROFILE_ZONE("draw_particles");
+        p.draw_particles(alpha);
+    }
+    {
+        PROFILE_ZONE_COUNT("end_frame", draw_calls);
+        end_frame();
+    }
 }
 
-SDL_AppResult SDL_AppInit(void ** /*appstate*/, int /*argc*/, char ** /*argv*/)
+#ifndef __EMSCRIPTEN__
+static void run_game()
+{
+    while (game_running) {
+        run_frame();
+        if (key[KEY_QUIT])
+            game_running = false;
+    }
+}
+#endif
+
+SDL_AppResult SDL_AppInit(void ** /*appstate*/, int argc, char **argv)
 {
     if (!init()) {
         print_error("Failed to initialize SDL (%s)", SDL_GetError());
@@ -73,11 +89,34 @@ SDL_AppResult SDL_AppInit(void ** /*appstate*/, int /*argc*/, char ** /*argv*/)
         return SDL_APP_FAILURE;
     }
 
-    std::srand(std::time(nullptr));
+    // Optionally record the input to, or play it back from a file, and use worker threads.
+    // A recording keeps its simulation rate, which takes precedence over --hz.
+    uint64_t seed = std::time(nullptr);
+    float rate = 60.f;
+    for (int i = 1; i + 1 < argc; i++) {
+        if (std::strcmp(argv[i], "--threads") == 0)
+            p.set_worker_threads(std::atoi(argv[i + 1]));
+        if (std::strcmp(argv[i], "--hz") == 0 && std::atoi(argv[i + 1]) > 0)
+            rate = std::atoi(argv[i + 1]);
+    }
+    for (int i = 1; i + 1 < argc; i++) {
+        if (std::strcmp(argv[i], "--record") == 0 && !start_recording(argv[i + 1], seed, rate))
+            return SDL_APP_FAILURE;
+        if (std::strcmp(argv[i], "--play") == 0 && !start_playback(argv[i + 1], seed, rate))
+            return SDL_APP_FAILURE;
+    }
+    timestep.set_rate(rate);
+    p.random.seed(seed);
 
     // Add initial particles to the particle system
-    p.add_particle(new BreakoutGame);
-    p.add_particle(new StarField);
+    p.add_particle<BreakoutGame>();
+    p.add_particle<StarField>();
+
+#ifndef __EMSCRIPTEN__
+    sample_input();
+    game_running = true;
+    game_thread = std::thread(run_game);
+#endif
 
     return SDL_APP_CONTINUE;
 }
@@ -99,15 +138,15 @@ SDL_AppResult SDL_AppIterate(void * /*appstate*/)
         emscripten_set_main_loop_timing(EM_TIMING_RAF, 1);
         forcedRafTiming = true;
     }
-#endif
-
-    update_input_state();
-    p.update_particles(delta_time);
-    p.draw_particles();
-    present();
 
-#ifndef __EMSCRIPTEN__
-    if (key[KEY_QUIT]) {
+    sample_input();
+    run_frame();
+    (void)draw_frame(0);
+#else
+    // Shows the frames published by the game thread
+    sample_input();
+    (void)draw_frame(100);
+    if (!game_running) {
         return SDL_APP_SUCCESS;
     }
 #endif
@@ -117,6 +156,13 @@ SDL_AppResult SDL_AppIterate(void * /*appstate*/)
 
 void SDL_AppQuit(void * /*appstate*/, SDL_AppResult /*result*/)
 {
+#ifndef __EMSCRIPTEN__
+    game_running = false;
+    stop_frames();
+    if (game_thread.joinable())
+        game_thread.join();
+#endif
+    stop_replay();
     p.remove_particles();
     shutdown();
 }
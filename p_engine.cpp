@@ -1,8 +1,10 @@
 /**********************************************************************************************
  *  Particle engine by Bjørn Lindeijer
- *  Version 0.9
+ *  Version 1.1
  *
  *  Changes:
+ *   1.1: Optional worker threads for the update phases.
+ *   1.0: Added Particle_Array, a structure-of-arrays storage for simple particles.
  *   0.9: Changed the way particles are defined. Particles should now be derived from
  *        the base Particle class.
  *   0.8: More gravity support and bounding boxes.
@@ -13,230 +15,1626 @@
 
 #include "p_engine.h"
 #include "base.h"
+#include "box_overlap.h"
+#include "point_gravity.h"
+#include "profiler.h"
+#include "worker_pool.h"
+
+Particle_Counters particle_counters;
 
 //=====   Particle class   ==================================================================//
 
-Particle::Particle() = default;
+Particle::Particle()
+    : layer(DL_OBJECTS)
+{
+}
 
-//=====   Particle System class   ===========================================================//
+void Particle::set_gravity_type(GravityType type)
+{
+    g_type = type;
+    if (system)
+        system->type_changed(this);
+}
 
-Particle_System::Particle_System() = default;
+void Particle::set_obstacle_type(ObstacleType type)
+{
+    o_type = type;
+    if (system)
+        system->type_changed(this);
+}
 
-Particle_System::~Particle_System()
+void Particle::sleep(float time)
+{
+    if (system)
+        system->sleep_particle(this, time);
+}
+
+void Particle::wake()
+{
+    if (system)
+        system->wake_particle(this);
+}
+
+Particle_System *Particle::particle_system() const
+{
+    return dynamic_cast<Particle_System *>(system);
+}
+
+//=====   Particle Grid class   =============================================================//
+
+Particle_Grid::Particle_Grid(float x_min, float y_min, int icolumns, int irows, float icell_w, float icell_h)
+    : columns(icolumns)
+    , rows(irows)
+    , cell_w(icell_w)
+    , cell_h(icell_h)
+    , solid(columns * rows, 0)
+{
+    w = columns * cell_w;
+    h = rows * cell_h;
+    x = x_min + w / 2;
+    y = y_min + h / 2;
+    o_type = ObstacleType::Grid;
+}
+
+bool Particle_Grid::cells_in(float x1, float y1, float x2, float y2, int &c1, int &r1, int &c2, int &r2) const
+{
+    // Cells that overlap the box by more than just touching it
+    const float left = x - w / 2, top = y - h / 2;
+    c1 = std::max(0, static_cast<int>(std::floor((x1 - left) / cell_w)));
+    r1 = std::max(0, static_cast<int>(std::floor((y1 - top) / cell_h)));
+    c2 = std::min(columns - 1, static_cast<int>(std::ceil((x2 - left) / cell_w)) - 1);
+    r2 = std::min(rows - 1, static_cast<int>(std::ceil((y2 - top) / cell_h)) - 1);
+    return c1 <= c2 && r1 <= r2;
+}
+
+void Particle_Grid::remove_cell(int cell)
+{
+    if (solid[cell] != SOLID)
+        return;
+    if (!system) {
+        solid[cell] = EMPTY;
+        cell_removed(cell);
+        return;
+    }
+
+    solid[cell] = REMOVING;
+    if (removed_cells.empty())
+        system->queue_cell_removals(this);
+    removed_cells.push_back(cell);
+}
+
+void Particle_Grid::remove_queued_cells()
+{
+    // cell_removed() may remove more cells
+    for (size_t i = 0; i < removed_cells.size(); i++) {
+        solid[removed_cells[i]] = EMPTY;
+        cell_removed(removed_cells[i]);
+    }
+    removed_cells.clear();
+}
+
+//=====   Particle System class   ===========================================================//
+
+Particle_System_Base::Particle_System_Base()
+    : workers(std::make_shared<Worker_Pool>())
+    , worker_scratch(1)
 {
-    remove_particles();
 }
 
-void Particle_System::add_particle(Particle *p)
+Particle_System_Base::~Particle_System_Base() = default;
+
+void Particle_System_Base::add_particle(Particle *p)
 {
+    if (in_parallel) {
+        // Added at the sync point after the parallel updates
+        std::lock_guard<std::mutex> lock(pending_mutex);
+        pending_particles.push_back(p);
+        return;
+    }
+
     if (first_particle)
         first_particle->prev = p;
     p->next = first_particle;
     p->system = this;
     first_particle = p;
     nr_of_particles++;
+    link_awake(p);
 
     p->initialize();
+    p->prev_x = p->x;
+    p->prev_y = p->y;
     set_obstacle(p);
     set_grav_source(p);
 }
 
-void Particle_System::remove_particle(Particle *p)
+void Particle_System_Base::remove_particle(Particle *p)
 {
+    if (updating) {
+        // The update phases may still refer to the particle, leave it to the removal phase,
+        // which only looks at the particles that are awake
+        if (!p->removing) {
+            p->life = 0;
+            wake_particle(p);
+        }
+        return;
+    }
+
     if (p->prev)
         p->prev->next = p->next;
     else
         first_particle = p->next;
     if (p->next)
         p->next->prev = p->prev;
+    if (p->type_changed)
+        changed_particles.erase(std::find(changed_particles.begin(), changed_particles.end(), p));
+    wake_particle(p);
+    unlink_awake(p);
 
     p->g_type = GravityType::None;
     p->o_type = ObstacleType::None;
     set_obstacle(p);
     set_grav_source(p);
     p->remove();
-    delete p;
+    destroy_particle(p, true);
 
     nr_of_particles--;
 }
 
-void Particle_System::remove_particles()
+void Particle_System_Base::remove_particles()
 {
-    while (first_particle)
-        remove_particle(first_particle);
+    // Call remove() while the system is still whole. As during an update, removing a particle
+    // from remove() only sets its life to 0. Particles added by remove() are put in front of
+    // the list, so repeat until remove() has been called on all of them.
+    updating = true;
+    Particle *removed = nullptr; // remove() has been called from here to the end of the list
+    while (first_particle != removed) {
+        Particle *const stop = removed;
+        removed = first_particle;
+        for (Particle *p = removed; p != stop; p = p->next) {
+            p->removing = true;
+            p->remove();
+        }
+    }
+    updating = false;
+
+    // Drop the obstacles and gravity sources and the pool as a whole, instead of one by one.
+    clear_features();
+    changed_particles.clear();
+    first_awake = nullptr;
+    timed_sleepers.clear();
+    removing_grids.clear();
+
+    while (first_particle) {
+        Particle *p = first_particle;
+        first_particle = p->next;
+        if (first_particle)
+            first_particle->prev = nullptr;
+
+        p->g_type = GravityType::None;
+        p->o_type = ObstacleType::None;
+        p->obstacle = nullptr;
+        p->grav_source = Particle::NO_GRAV_SOURCE;
+        destroy_particle(p, false);
+
+        nr_of_particles--;
+    }
+
+    pool.reset();
 }
 
-void Particle_System::update_particles(float dt)
+void *Particle_System_Base::allocate_particle(size_t size)
 {
-    Particle *p = first_particle;
-    Particle *temp_p;
-    float Dx, Dy, squares;
-    bool bounce_x, bounce_y;
+    std::unique_lock<std::mutex> lock(pending_mutex, std::defer_lock);
+    if (in_parallel)
+        lock.lock();
+    return pool.allocate(size);
+}
 
-    while (p) {
-        if (p->life <= 0) {
-            temp_p = p;
-            p = p->next;
-            remove_particle(temp_p);
-        } else {
-            if (p->gravity > 0) {
-                // Calculate effect of gravity sources on this particle.
-                Modifier *g = first_grav_source;
-                while (g) {
-                    if (g->p != p) {
-                        switch (g->p->g_type) {
-                        case GravityType::Constant:
-                            p->dx += p->gravity * g->p->gx * dt;
-                            p->dy += p->gravity * g->p->gy * dt;
-                            break;
-                        case GravityType::Point:
-                            Dx = g->p->x - p->x;
-                            Dy = g->p->y - p->y;
-                            squares = (Dx * Dx + Dy * Dy);
-                            p->dx += p->gravity * (g->p->gx / squares) / sqrt(squares) * Dx * dt;
-                            p->dy += p->gravity * (g->p->gy / squares) / sqrt(squares) * Dy * dt;
-                            break;
-                        case GravityType::Line:
-                            Dx = g->p->x - p->x;
-                            Dy = g->p->y - p->y;
-                            p->dx += p->gravity * (g->p->gx / (Dx * Dx * SGN(Dx))) * dt;
-                            p->dy += p->gravity * (g->p->gy / (Dy * Dy * SGN(Dy))) * dt;
-                            break;
-                        case GravityType::None: break;
-                        }
-                    }
-                    g = g->next;
+void Particle_System_Base::set_worker_threads(unsigned int n)
+{
+    if (n == 0)
+        n = std::thread::hardware_concurrency();
+    workers = std::make_shared<Worker_Pool>(n);
+    worker_scratch.resize(workers->size());
+}
+
+void Particle_System_Base::share_worker_threads(const Particle_System_Base &other)
+{
+    workers = other.workers;
+    worker_scratch.resize(workers->size());
+}
+
+void Particle_System_Base::destroy_particle(Particle *p, bool free_block)
+{
+    const size_t pool_size = p->pool_size;
+    if (pool_size == 0) {
+        delete p;
+        return;
+    }
+
+    p->~Particle();
+    if (free_block)
+        pool.free(p, pool_size);
+}
+
+Modifier *Particle_System_Base::new_modifier(Particle *p)
+{
+    return new (pool.allocate(sizeof(Modifier))) Modifier(p);
+}
+
+void Particle_System_Base::delete_modifier(Modifier *m)
+{
+    m->~Modifier();
+    pool.free(m, sizeof(Modifier));
+}
+
+void Particle_System_Base::begin_update(float dt)
+{
+    apply_type_changes();
+
+    clock += dt;
+    for (size_t i = 0; i < timed_sleepers.size();) {
+        if (timed_sleepers[i]->wake_time <= clock)
+            wake_particle(timed_sleepers[i]); // Removes it from timed_sleepers
+        else
+            i++;
+    }
+
+    updating = true;
+    update_list.clear();
+    parallel_list.clear();
+    for (Particle *p = first_awake; p; p = p->next_awake) {
+        update_list.push_back(p);
+        if (p->parallel_update)
+            parallel_list.push_back(p);
+    }
+}
+
+void Particle_System_Base::apply_gravity(Gravity_State &g, float dt)
+{
+    PROFILE_ZONE("gravity");
+    if (g.sources.empty())
+        return;
+
+    g.field.gather(g.sources);
+    const size_t n = update_list.size();
+    workers->parallel_for(n, PARALLEL_CHUNK_SIZE, [this, &g, dt](size_t begin, size_t end, unsigned int) {
+        for (size_t i = begin; i < end; i++) {
+            if (update_list[i]->gravity > 0)
+                g.field.apply(update_list[i], dt);
+        }
+    });
+}
+
+void Particle_System_Base::resolve_collisions(Obstacle_State &o, float dt)
+{
+    PROFILE_ZONE_COUNT("collision", particle_counters.collision_tests);
+    const size_t n = update_list.size();
+
+    o.swept_list.clear();
+    for (Particle *p : update_list) {
+        if (p->fast_mover && p->affected_by_obstacle)
+            o.swept_list.push_back(p);
+    }
+
+    // Obstacles may have been moved since their update, by other particles
+    for (Modifier *m : o.obstacles)
+        o.grid.update(m);
+
+    // Find the collisions against the positions at the start of the phase, then report them
+    // and bounce in the order of the particles, as if it were done one by one.
+    o.chunk_contacts.resize((n + PARALLEL_CHUNK_SIZE - 1) / PARALLEL_CHUNK_SIZE);
+    workers->parallel_for(n, PARALLEL_CHUNK_SIZE, [this, &o](size_t begin, size_t end, unsigned int worker) {
+        auto &contacts = o.chunk_contacts[begin / PARALLEL_CHUNK_SIZE];
+        contacts.clear();
+        for (size_t i = begin; i < end; i++) {
+            if (update_list[i]->affected_by_obstacle && !update_list[i]->fast_mover)
+                collide_with_obstacles(o, update_list[i], worker_scratch[worker], contacts);
+        }
+    });
+
+    for (auto &scratch : worker_scratch) {
+        particle_counters.collision_tests += scratch.collision_tests;
+        scratch.collision_tests = 0;
+    }
+    for (const auto &contacts : o.chunk_contacts) {
+        for (const Contact &c : contacts) {
+            if (c.o)
+                report_contact(c);
+            if (c.bounce_x)
+                c.p->dx *= -1;
+            if (c.bounce_y)
+                c.p->dy *= -1;
+        }
+    }
+
+    // Fast movers are moved here, by sweeping them along their path
+    for (Particle *p : o.swept_list)
+        sweep_through_obstacles(o, p, dt);
+}
+
+void Particle_System_Base::integrate(float dt, bool skip_swept)
+{
+    PROFILE_ZONE_COUNT("integration", particle_counters.particles_updated);
+    const size_t n = update_list.size();
+    workers->parallel_for(n, PARALLEL_CHUNK_SIZE, [this, dt, skip_swept](size_t begin, size_t end, unsigned int) {
+        for (size_t i = begin; i < end; i++) {
+            Particle *p = update_list[i];
+            if (skip_swept && p->fast_mover && p->affected_by_obstacle)
+                continue; // Moved by resolve_collisions()
+            p->prev_x = p->x;
+            p->prev_y = p->y;
+            p->x += p->dx * dt;
+            p->y += p->dy * dt;
+        }
+    });
+    particle_counters.particles_updated += n;
+}
+
+void Particle_System_Base::call_updates(float dt)
+{
+    PROFILE_ZONE("update");
+
+    // Particles may have been woken by collisions. The particles of registered types are
+    // gathered per type, the others are kept in update_list.
+    update_list.clear();
+    for (Type_Group &group : type_groups)
+        group.particles.clear();
+    for (Particle *p = first_awake; p; p = p->next_awake) {
+        if (p->parallel_update)
+            continue;
+        if (p->type_group != Particle::NO_TYPE_GROUP)
+            type_groups[p->type_group].particles.push_back(p);
+        else
+            update_list.push_back(p);
+    }
+
+    if (!parallel_list.empty())
+        update_in_parallel(dt);
+
+    for (Particle *p : update_list) {
+        if (p->life > 0 && !p->sleeping)
+            p->update(dt);
+    }
+    for (const Type_Group &group : type_groups)
+        group.update(group.particles.data(), group.particles.size(), dt);
+}
+
+void Particle_System_Base::end_update()
+{
+    PROFILE_ZONE("removal");
+    remove_dead_particles();
+    updating = false;
+}
+
+void Particle_System_Base::queue_cell_removals(Particle_Grid *grid)
+{
+    if (!updating) {
+        grid->remove_queued_cells();
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(pending_mutex, std::defer_lock);
+    if (in_parallel)
+        lock.lock();
+    removing_grids.push_back(grid);
+}
+
+void Particle_System_Base::remove_dead_particles()
+{
+    // The grids may be dead themselves, so remove their cells first
+    for (size_t i = 0; i < removing_grids.size(); i++)
+        removing_grids[i]->remove_queued_cells();
+    removing_grids.clear();
+
+    // Dead particles are awake, remove_particle() wakes the sleeping ones
+    removal_list.clear();
+    bool obstacles_removed = false, grav_sources_removed = false, changes_removed = false;
+    for (Particle *p = first_awake; p; p = p->next_awake) {
+        if (p->life > 0)
+            continue;
+        p->removing = true;
+        removal_list.push_back(p);
+        obstacles_removed |= p->obstacle != nullptr;
+        grav_sources_removed |= p->grav_source != Particle::NO_GRAV_SOURCE;
+        changes_removed |= p->type_changed;
+    }
+    if (removal_list.empty())
+        return;
+
+    for (Particle *p : removal_list) {
+        if (p->prev)
+            p->prev->next = p->next;
+        else
+            first_particle = p->next;
+        if (p->next)
+            p->next->prev = p->prev;
+        unlink_awake(p);
+    }
+
+    // Compact the registries in one pass each, instead of removing the particles one by one
+    forget_removed(obstacles_removed, grav_sources_removed);
+    if (changes_removed) {
+        changed_particles.erase(
+            std::remove_if(changed_particles.begin(), changed_particles.end(), [](Particle *p) { return p->removing; }),
+            changed_particles.end());
+    }
+
+    for (Particle *p : removal_list) {
+        p->g_type = GravityType::None;
+        p->o_type = ObstacleType::None;
+        p->remove();
+    }
+    for (Particle *p : removal_list)
+        destroy_particle(p, true);
+    nr_of_particles -= static_cast<unsigned int>(removal_list.size());
+}
+
+void Particle_System_Base::update_in_parallel(float dt)
+{
+    in_parallel = true;
+    const size_t n = parallel_list.size();
+    workers->parallel_for(n, PARALLEL_CHUNK_SIZE, [this, dt](size_t begin, size_t end, unsigned int) {
+        for (size_t i = begin; i < end; i++) {
+            if (parallel_list[i]->life > 0)
+                parallel_list[i]->update(dt);
+        }
+    });
+    in_parallel = false;
+
+    // Sync point: add the particles created by the parallel updates
+    for (Particle *p : pending_particles)
+        add_particle(p);
+    pending_particles.clear();
+}
+
+void Particle_System_Base::collide_with_obstacles(const Obstacle_State &o,
+                                                  Particle *p,
+                                                  Worker_Scratch &scratch,
+                                                  std::vector<Contact> &contacts) const
+{
+    // Check for collisions with other particles and calculate the result.
+    bool bounce_x = false;
+    bool bounce_y = false;
+    // p->colliding_particles.clear();
+    bool colliding = false;
+
+    // Handles p overlapping a rectangle centred at ox, oy, which belongs to o.
+    auto hit_rect = [&](float ox, float oy, float ow, float oh, Particle *o, int cell) {
+        float Dx, Dy;
+
+        // p->colliding_particles.push_back(o);
+        colliding = true;
+
+        if (!p->colliding /*_particles->is_in(o)*/) {
+            if (p->dy == 0)
+                bounce_x = true;
+            else if (p->dx == 0)
+                bounce_y = true;
+            else {
+                if (p->dx < 0)
+                    Dx = (p->x - p->w / 2) - (ox + ow / 2);
+                else
+                    Dx = (p->x + p->w / 2) - (ox - ow / 2);
+
+                if (p->dy < 0)
+                    Dy = (p->y - p->h / 2) - (oy + oh / 2);
+                else
+                    Dy = (p->y + p->h / 2) - (oy - oh / 2);
+
+                if (SGN(p->dx) == SGN(p->dy)) {
+                    if (Dx / Dy < p->dx / p->dy)
+                        bounce_x = true;
+                    else
+                        bounce_y = true;
+                } else {
+                    if (Dx / Dy < p->dx / p->dy)
+                        bounce_y = true;
+                    else
+                        bounce_x = true;
                 }
             }
-            if (p->affected_by_obstacle) {
-                // Check for collisions with other particles and calculate the result.
-                Modifier *o = first_obstacle;
-                bounce_x = false;
-                bounce_y = false;
-                // p->colliding_particles.clear();
-                bool colliding = false;
-                while (o) {
-                    if (o->p != p) {
-                        switch (o->p->o_type) {
-                        case ObstacleType::Rect:
-                            if ((p->x + p->w / 2) > (o->p->x - o->p->w / 2) &&
-                                (p->y + p->h / 2) > (o->p->y - o->p->h / 2) &&
-                                (p->x - p->w / 2) < (o->p->x + o->p->w / 2) &&
-                                (p->y - p->h / 2) < (o->p->y + o->p->h / 2)) {
-
-                                // p->colliding_particles.push_back(o->p);
-                                colliding = true;
-
-                                if (!p->colliding /*_particles->is_in(o->p)*/) {
-                                    if (p->dy == 0)
-                                        bounce_x = true;
-                                    else if (p->dx == 0)
-                                        bounce_y = true;
-                                    else {
-                                        if (p->dx < 0)
-                                            Dx = (p->x - p->w / 2) - (o->p->x + o->p->w / 2);
-                                        else
-                                            Dx = (p->x + p->w / 2) - (o->p->x - o->p->w / 2);
-
-                                        if (p->dy < 0)
-                                            Dy = (p->y - p->h / 2) - (o->p->y + o->p->h / 2);
-                                        else
-                                            Dy = (p->y + p->h / 2) - (o->p->y - o->p->h / 2);
-
-                                        if (SGN(p->dx) == SGN(p->dy)) {
-                                            if (Dx / Dy < p->dx / p->dy)
-                                                bounce_x = true;
-                                            else
-                                                bounce_y = true;
-                                        } else {
-                                            if (Dx / Dy < p->dx / p->dy)
-                                                bounce_y = true;
-                                            else
-                                                bounce_x = true;
-                                        }
-                                    }
-                                    p->collision(o->p);
-                                    o->p->collision(p);
-                                }
-                            }
-                            break;
-                        case ObstacleType::None: break;
-                        }
-                    }
-                    o = o->next;
+            contacts.push_back({p, o, cell, false, false});
+        }
+    };
+
+    // The grid only returns obstacles whose bounding box overlaps p
+    const float x1 = p->x - p->w / 2, y1 = p->y - p->h / 2;
+    const float x2 = p->x + p->w / 2, y2 = p->y + p->h / 2;
+    o.grid.query(x1, y1, x2, y2, p->collides_with, scratch.nearby_obstacles, scratch.collision_tests);
+
+    for (Modifier *m : scratch.nearby_obstacles) {
+        if (m->p == p)
+            continue;
+
+        switch (m->p->o_type) {
+        case ObstacleType::Rect: hit_rect(m->p->x, m->p->y, m->p->w, m->p->h, m->p, -1); break;
+        case ObstacleType::Grid: {
+            const auto *grid = static_cast<const Particle_Grid *>(m->p);
+            int c1, r1, c2, r2;
+            if (!grid->cells_in(x1, y1, x2, y2, c1, r1, c2, r2))
+                break;
+            for (int row = r1; row <= r2; row++) {
+                for (int column = c1; column <= c2; column++) {
+                    const int cell = grid->cell_index(column, row);
+                    if (!grid->is_solid(cell))
+                        continue;
+                    scratch.collision_tests++;
+                    const float ox = grid->cell_x(column), oy = grid->cell_y(row);
+                    if (x2 > ox - grid->cell_w / 2 && y2 > oy - grid->cell_h / 2 && x1 < ox + grid->cell_w / 2 &&
+                        y1 < oy + grid->cell_h / 2)
+                        hit_rect(ox, oy, grid->cell_w, grid->cell_h, m->p, cell);
                 }
-                if (bounce_x)
-                    p->dx *= -1;
-                if (bounce_y)
-                    p->dy *= -1;
-                p->colliding = colliding;
             }
+            break;
+        }
+        case ObstacleType::None: break;
+        }
+    }
+    if (bounce_x || bounce_y)
+        contacts.push_back({p, nullptr, -1, bounce_x, bounce_y});
+    p->colliding = colliding;
+}
 
-            p->x += p->dx * dt;
-            p->y += p->dy * dt;
-            p->update(dt);
-            set_obstacle(p);
-            set_grav_source(p);
+void Particle_System_Base::sweep_through_obstacles(Obstacle_State &o, Particle *p, float dt)
+{
+    constexpr int MAX_HITS_PER_UPDATE = 4; // After this many bounces, p stops for this update
+    constexpr float SIMULTANEOUS = 1e-4f; // Hits this close, as fraction of the path, are at the same time
+
+    Worker_Scratch &scratch = worker_scratch[0];
+    p->prev_x = p->x;
+    p->prev_y = p->y;
 
-            p = p->next;
+    // Obstacles that p already overlaps, like one that moved onto it, cannot be swept. They
+    // bounce p as if it were not a fast mover, after which the sweep lets it move out of them.
+    o.swept_hits.clear();
+    collide_with_obstacles(o, p, scratch, o.swept_hits);
+    particle_counters.collision_tests += scratch.collision_tests;
+    scratch.collision_tests = 0;
+    for (const Contact &c : o.swept_hits) {
+        if (c.o)
+            report_contact(c);
+        if (c.bounce_x)
+            p->dx *= -1;
+        if (c.bounce_y)
+            p->dy *= -1;
+    }
+
+    for (int i = 0; i < MAX_HITS_PER_UPDATE && dt > 0; i++) {
+        const float move_x = p->dx * dt, move_y = p->dy * dt;
+        const float x1 = std::min(p->x, p->x + move_x) - p->w / 2, x2 = std::max(p->x, p->x + move_x) + p->w / 2;
+        const float y1 = std::min(p->y, p->y + move_y) - p->h / 2, y2 = std::max(p->y, p->y + move_y) + p->h / 2;
+        o.grid.query(x1, y1, x2, y2, p->collides_with, scratch.nearby_obstacles, particle_counters.collision_tests);
+
+        // Find the earliest hits, as fraction of the path. Obstacles that p already overlaps
+        // when starting are not hit, so it can move out of them.
+        float first_hit = 1.f;
+        bool hit_x = false, hit_y = false, hit_corner = false;
+        o.swept_hits.clear();
+
+        // Sweeps p against a rectangle centred at ox, oy, which belongs to owner.
+        auto sweep_rect = [&](float ox, float oy, float ow, float oh, Particle *owner, int cell) {
+            // Move the point p->x, p->y through the rectangle grown by the size of p
+            const float rx1 = ox - (ow + p->w) / 2, rx2 = ox + (ow + p->w) / 2;
+            const float ry1 = oy - (oh + p->h) / 2, ry2 = oy + (oh + p->h) / 2;
+            float enter_x, leave_x, enter_y, leave_y;
+            if (move_x != 0) {
+                enter_x = ((move_x > 0 ? rx1 : rx2) - p->x) / move_x;
+                leave_x = ((move_x > 0 ? rx2 : rx1) - p->x) / move_x;
+            } else if (p->x > rx1 && p->x < rx2) {
+                enter_x = -INFINITY;
+                leave_x = INFINITY;
+            } else
+                return;
+            if (move_y != 0) {
+                enter_y = ((move_y > 0 ? ry1 : ry2) - p->y) / move_y;
+                leave_y = ((move_y > 0 ? ry2 : ry1) - p->y) / move_y;
+            } else if (p->y > ry1 && p->y < ry2) {
+                enter_y = -INFINITY;
+                leave_y = INFINITY;
+            } else
+                return;
+
+            const float enter = std::max(enter_x, enter_y);
+            if (enter < 0 || enter > 1 || enter >= std::min(leave_x, leave_y))
+                return;
+            if (o.swept_hits.empty() || enter < first_hit - SIMULTANEOUS) {
+                hit_x = hit_y = hit_corner = false;
+                o.swept_hits.clear();
+            } else if (enter > first_hit + SIMULTANEOUS)
+                return;
+            first_hit = o.swept_hits.empty() ? enter : std::min(first_hit, enter);
+            o.swept_hits.push_back({p, owner, cell, false, false});
+
+            // The side that was reached last is the one that was hit
+            if (enter_x > enter_y + SIMULTANEOUS)
+                hit_x = true;
+            else if (enter_y > enter_x + SIMULTANEOUS)
+                hit_y = true;
+            else
+                hit_corner = true;
+        };
+
+        for (Modifier *m : scratch.nearby_obstacles) {
+            if (m->p == p)
+                continue;
+
+            switch (m->p->o_type) {
+            case ObstacleType::Rect: sweep_rect(m->p->x, m->p->y, m->p->w, m->p->h, m->p, -1); break;
+            case ObstacleType::Grid: {
+                const auto *grid = static_cast<const Particle_Grid *>(m->p);
+                int c1, r1, c2, r2;
+                if (!grid->cells_in(x1, y1, x2, y2, c1, r1, c2, r2))
+                    break;
+                for (int row = r1; row <= r2; row++) {
+                    for (int column = c1; column <= c2; column++) {
+                        const int cell = grid->cell_index(column, row);
+                        if (!grid->is_solid(cell))
+                            continue;
+                        particle_counters.collision_tests++;
+                        sweep_rect(grid->cell_x(column), grid->cell_y(row), grid->cell_w, grid->cell_h, m->p, cell);
+                    }
+                }
+                break;
+            }
+            case ObstacleType::None: break;
+            }
         }
+
+        p->x += move_x * first_hit;
+        p->y += move_y * first_hit;
+        dt -= dt * first_hit;
+        if (p->obstacle)
+            o.grid.update(p->obstacle); // Other particles see where p has moved to
+        if (o.swept_hits.empty())
+            break;
+
+        for (const Contact &c : o.swept_hits)
+            report_contact(c);
+
+        // A corner only counts when nothing else was hit, so a particle hitting two obstacles
+        // side by side at their seam bounces off their common side once.
+        if (hit_corner && !hit_x && !hit_y)
+            hit_x = hit_y = true;
+        if (hit_x)
+            p->dx *= -1;
+        if (hit_y)
+            p->dy *= -1;
     }
+
+    // As for the other particles, colliding tells whether p overlaps an obstacle where it is
+    // now, so that one moving onto it next update still bounces it. Only touching an obstacle
+    // after a hit does not count. The contacts of this test are not reported.
+    o.swept_hits.clear();
+    collide_with_obstacles(o, p, scratch, o.swept_hits);
+    particle_counters.collision_tests += scratch.collision_tests;
+    scratch.collision_tests = 0;
 }
 
-void Particle_System::draw_particles()
+void Particle_System_Base::report_contact(const Contact &c)
 {
-    for (Particle *p = first_particle; p; p = p->next)
-        p->draw();
+    wake_particle(c.o);
+    c.p->collision(c.o);
+    if (c.cell >= 0)
+        static_cast<Particle_Grid *>(c.o)->cell_collision(c.cell, c.p);
+    else
+        c.o->collision(c.p);
 }
 
-void Particle_System::set_obstacle(Particle *p)
+void Particle_System_Base::draw_particles(float alpha)
 {
-    if (p->obstacle && p->o_type == ObstacleType::None) {
-        // Remove obstacle from list
-        if (p->obstacle->prev)
-            p->obstacle->prev->next = p->obstacle->next;
+    draw_alpha = alpha;
+    for (Type_Group &group : type_groups)
+        group.particles.clear();
+
+    for (Particle *p = first_particle; p; p = p->next) {
+        if (p->type_group != Particle::NO_TYPE_GROUP)
+            type_groups[p->type_group].particles.push_back(p);
         else
-            first_obstacle = p->obstacle->next;
-        if (p->obstacle->next)
-            p->obstacle->next->prev = p->obstacle->prev;
-        delete p->obstacle;
+            draw_at(p, alpha, [](Particle *q) { q->draw(); });
+    }
+    for (const Type_Group &group : type_groups)
+        group.draw(group.particles.data(), group.particles.size(), alpha);
+}
+
+void Particle_System_Base::set_layer(const Particle *p)
+{
+    set_draw_order(p->layer);
+}
+
+size_t Particle_System_Base::find_type_group(const void *key) const
+{
+    for (size_t i = 0; i < type_groups.size(); i++) {
+        if (type_groups[i].key == key)
+            return i;
+    }
+    return Particle::NO_TYPE_GROUP;
+}
+
+void Particle_System_Base::type_changed(Particle *p)
+{
+    // Parallel updates may change their own particle
+    std::unique_lock<std::mutex> lock(pending_mutex, std::defer_lock);
+    if (in_parallel)
+        lock.lock();
+    if (!p->type_changed) {
+        p->type_changed = true;
+        changed_particles.push_back(p);
+    }
+}
+
+void Particle_System_Base::apply_type_changes()
+{
+    for (Particle *p : changed_particles) {
+        p->type_changed = false;
+        set_obstacle(p);
+        set_grav_source(p);
+    }
+    changed_particles.clear();
+}
+
+void Particle_System_Base::sleep_particle(Particle *p, float time)
+{
+    // Parallel updates may put their own particle to sleep
+    std::unique_lock<std::mutex> lock(pending_mutex, std::defer_lock);
+    if (in_parallel)
+        lock.lock();
+
+    if (!p->sleeping) {
+        unlink_awake(p);
+        p->sleeping = true;
+        p->prev_x = p->x; // Drawn where it stopped
+        p->prev_y = p->y;
+    }
+
+    const bool was_timed = p->wake_time > 0;
+    p->wake_time = time > 0 ? clock + time : 0.0;
+    if (time > 0 && !was_timed)
+        timed_sleepers.push_back(p);
+    else if (time <= 0 && was_timed)
+        timed_sleepers.erase(std::find(timed_sleepers.begin(), timed_sleepers.end(), p));
+}
+
+void Particle_System_Base::wake_particle(Particle *p)
+{
+    if (!p->sleeping)
+        return;
+
+    std::unique_lock<std::mutex> lock(pending_mutex, std::defer_lock);
+    if (in_parallel)
+        lock.lock();
+
+    p->sleeping = false;
+    if (p->wake_time > 0) {
+        timed_sleepers.erase(std::find(timed_sleepers.begin(), timed_sleepers.end(), p));
+        p->wake_time = 0.0;
+    }
+    link_awake(p);
+}
+
+void Particle_System_Base::link_awake(Particle *p)
+{
+    if (first_awake)
+        first_awake->prev_awake = p;
+    p->prev_awake = nullptr;
+    p->next_awake = first_awake;
+    first_awake = p;
+}
+
+void Particle_System_Base::unlink_awake(Particle *p)
+{
+    if (p->prev_awake)
+        p->prev_awake->next_awake = p->next_awake;
+    else
+        first_awake = p->next_awake;
+    if (p->next_awake)
+        p->next_awake->prev_awake = p->prev_awake;
+    p->prev_awake = p->next_awake = nullptr;
+}
+
+void Particle_System_Base::update_obstacle(Obstacle_State &o, Particle *p)
+{
+    if (p->obstacle && p->o_type == ObstacleType::None) {
+        // Remove obstacle, by moving the last one in its place
+        Modifier *last = o.obstacles.back();
+        last->index = p->obstacle->index;
+        o.obstacles[last->index] = last;
+        o.obstacles.pop_back();
+        o.grid.remove(p->obstacle);
+        delete_modifier(p->obstacle);
         p->obstacle = nullptr;
     } else if (!p->obstacle && p->o_type != ObstacleType::None) {
-        // Add obstacle to list
-        auto *new_o = new Modifier(p);
-        if (first_obstacle) {
-            first_obstacle->prev = new_o;
-            new_o->next = first_obstacle;
-            first_obstacle = new_o;
+        // Add obstacle
+        auto *new_o = new_modifier(p);
+        new_o->index = o.obstacles.size();
+        o.obstacles.push_back(new_o);
+        p->obstacle = new_o;
+        o.grid.insert(new_o);
+    } else if (p->obstacle) {
+        // Obstacle may have moved
+        o.grid.update(p->obstacle);
+    }
+}
+
+void Particle_System_Base::update_grav_source(Gravity_State &g, Particle *p)
+{
+    if (p->grav_source != Particle::NO_GRAV_SOURCE && p->g_type == GravityType::None) {
+        // Remove gravity source, by moving the last one in its place
+        Particle *last = g.sources.back();
+        last->grav_source = p->grav_source;
+        g.sources[last->grav_source] = last;
+        g.sources.pop_back();
+        p->grav_source = Particle::NO_GRAV_SOURCE;
+    } else if (p->grav_source == Particle::NO_GRAV_SOURCE && p->g_type != GravityType::None) {
+        // Add gravity source
+        p->grav_source = g.sources.size();
+        g.sources.push_back(p);
+    }
+}
+
+void Particle_System_Base::forget_removed_obstacles(Obstacle_State &o)
+{
+    size_t kept = 0;
+    for (Modifier *m : o.obstacles) {
+        if (m->p->removing) {
+            o.grid.remove(m);
+            m->p->obstacle = nullptr;
+            delete_modifier(m);
         } else {
-            first_obstacle = new_o;
+            m->index = kept;
+            o.obstacles[kept++] = m;
         }
-        p->obstacle = new_o;
     }
+    o.obstacles.resize(kept);
 }
 
-void Particle_System::set_grav_source(Particle *p)
+void Particle_System_Base::forget_removed_grav_sources(Gravity_State &g)
 {
-    if (p->grav_source && p->g_type == GravityType::None) {
-        // Remove gravity source from list
-        if (p->grav_source->prev)
-            p->grav_source->prev->next = p->grav_source->next;
-        else
-            first_grav_source = p->grav_source->next;
-        if (p->grav_source->next)
-            p->grav_source->next->prev = p->grav_source->prev;
-        delete p->grav_source;
-        p->grav_source = nullptr;
-    } else if (!p->grav_source && p->g_type != GravityType::None) {
-        // Add gravity source to list
-        auto *new_g = new Modifier(p);
-        if (first_grav_source) {
-            first_grav_source->prev = new_g;
-            new_g->next = first_grav_source;
-            first_grav_source = new_g;
+    size_t kept = 0;
+    for (Particle *source : g.sources) {
+        if (source->removing) {
+            source->grav_source = Particle::NO_GRAV_SOURCE;
         } else {
-            first_grav_source = new_g;
+            source->grav_source = kept;
+            g.sources[kept++] = source;
         }
-        p->grav_source = new_g;
     }
+    g.sources.resize(kept);
+}
+
+//=====   Particle System template   ========================================================//
+
+template <unsigned Features>
+Particle_System_T<Features>::~Particle_System_T()
+{
+    remove_particles();
+}
+
+template <unsigned Features>
+void Particle_System_T<Features>::update_particles(float dt)
+{
+    // The particles are updated in phases, so that each phase sees all particles in the same
+    // state and can be measured on its own. Until the update phase, no particles are added or
+    // removed, so the phases before it work on a list of the particles taken at the start.
+    // The phases of missing features are left out.
+    begin_update(dt);
+    if constexpr (HAS_GRAVITY)
+        apply_gravity(gravity, dt);
+    if constexpr (HAS_OBSTACLES)
+        resolve_collisions(obstacles, dt);
+    integrate(dt, HAS_OBSTACLES);
+    call_updates(dt);
+    end_update();
+}
+
+template <unsigned Features>
+void Particle_System_T<Features>::set_obstacle(Particle *p)
+{
+    if constexpr (HAS_OBSTACLES)
+        update_obstacle(obstacles, p);
+}
+
+template <unsigned Features>
+void Particle_System_T<Features>::set_grav_source(Particle *p)
+{
+    if constexpr (HAS_GRAVITY)
+        update_grav_source(gravity, p);
+}
+
+template <unsigned Features>
+void Particle_System_T<Features>::forget_removed(bool obstacles_removed, bool grav_sources_removed)
+{
+    if constexpr (HAS_OBSTACLES) {
+        if (obstacles_removed)
+            forget_removed_obstacles(obstacles);
+    }
+    if constexpr (HAS_GRAVITY) {
+        if (grav_sources_removed)
+            forget_removed_grav_sources(gravity);
+    }
+}
+
+template <unsigned Features>
+void Particle_System_T<Features>::clear_features()
+{
+    if constexpr (HAS_OBSTACLES) {
+        obstacles.grid.clear();
+        obstacles.obstacles.clear();
+    }
+    if constexpr (HAS_GRAVITY)
+        gravity.sources.clear();
+}
+
+template class Particle_System_T<SF_NONE>;
+template class Particle_System_T<SF_GRAVITY>;
+template class Particle_System_T<SF_OBSTACLES>;
+template class Particle_System_T<SF_ALL>;
+
+//=====   Fixed Timestep class   ============================================================//
+
+float Fixed_Timestep::advance(Particle_System_Base &system, float frame_time)
+{
+    time_left = std::min(time_left + frame_time, MAX_STEPS_PER_FRAME * step);
+    while (time_left >= step) {
+        system.update_particles(step);
+        time_left -= step;
+    }
+    return time_left / step;
+}
+
+//=====   Particle Pool class   =============================================================//
+
+std::atomic<unsigned long> Particle_Pool::total_heap_allocations { 0 };
+std::atomic<unsigned long> Particle_Pool::total_allocations { 0 };
+std::atomic<unsigned long> Particle_Pool::total_frees { 0 };
+
+Pool_Stats Particle_Pool::total_stats()
+{
+    Pool_Stats totals;
+    totals.heap_allocations = total_heap_allocations.load(std::memory_order_relaxed);
+    totals.allocations = total_allocations.load(std::memory_order_relaxed);
+    totals.frees = total_frees.load(std::memory_order_relaxed);
+    return totals;
+}
+
+Particle_Pool::~Particle_Pool()
+{
+    reset();
+    for (auto &size_class : size_classes) {
+        for (char *chunk : size_class.chunks)
+            ::operator delete(chunk);
+    }
+}
+
+size_t Particle_Pool::size_class(size_t size)
+{
+    size_t index = 0;
+    for (size_t block_size = MIN_BLOCK_SIZE; block_size < size; block_size *= 2)
+        index++;
+    return index;
+}
+
+void *Particle_Pool::allocate(size_t size)
+{
+    pool_stats.allocations++;
+    total_allocations.fetch_add(1, std::memory_order_relaxed);
+
+    if (size > MAX_BLOCK_SIZE) {
+        pool_stats.heap_allocations++;
+        total_heap_allocations.fetch_add(1, std::memory_order_relaxed);
+        void *block = ::operator new(size);
+        large_blocks.push_back(block);
+        return block;
+    }
+
+    const size_t index = size_class(size);
+    Size_Class &sc = size_classes[index];
+
+    if (sc.free_list) {
+        Free_Block *block = sc.free_list;
+        sc.free_list = block->next;
+        return block;
+    }
+
+    const size_t block_size = MIN_BLOCK_SIZE << index;
+    if (sc.chunk < sc.chunks.size() && sc.used + block_size > CHUNK_SIZE) {
+        sc.chunk++;
+        sc.used = 0;
+    }
+    if (sc.chunk == sc.chunks.size()) {
+        pool_stats.heap_allocations++;
+        total_heap_allocations.fetch_add(1, std::memory_order_relaxed);
+        sc.chunks.push_back(static_cast<char *>(::operator new(CHUNK_SIZE)));
+    }
+
+    void *block = sc.chunks[sc.chunk] + sc.used;
+    sc.used += block_size;
+    return block;
+}
+
+void Particle_Pool::free(void *block, size_t size)
+{
+    pool_stats.frees++;
+    total_frees.fetch_add(1, std::memory_order_relaxed);
+
+    if (size > MAX_BLOCK_SIZE) {
+        auto it = std::find(large_blocks.begin(), large_blocks.end(), block);
+        if (it != large_blocks.end()) {
+            *it = large_blocks.back();
+            large_blocks.pop_back();
+        }
+        ::operator delete(block);
+        return;
+    }
+
+    Size_Class &sc = size_classes[size_class(size)];
+    auto *free_block = static_cast<Free_Block *>(block);
+    free_block->next = sc.free_list;
+    sc.free_list = free_block;
+}
+
+void Particle_Pool::reset()
+{
+    for (auto &sc : size_classes) {
+        sc.free_list = nullptr;
+        sc.chunk = 0;
+        sc.used = 0;
+    }
+    for (void *block : large_blocks)
+        ::operator delete(block);
+    large_blocks.clear();
+}
+
+//=====   Particle Array class   ============================================================//
+
+Particle_Array::~Particle_Array()
+{
+    remove_particles();
+}
+
+ParticleHandle Particle_Array::add_particle(float ix, float iy, float idx, float idy, ParticleKind *ikind)
+{
+    uint32_t slot;
+    if (free_slots.empty()) {
+        slot = static_cast<uint32_t>(index_of_slot.size());
+        index_of_slot.push_back(0);
+        generation_of_slot.push_back(0);
+    } else {
+        slot = free_slots.back();
+        free_slots.pop_back();
+    }
+    index_of_slot[slot] = static_cast<uint32_t>(x.size());
+    slot_of_index.push_back(slot);
+
+    x.push_back(ix);
+    y.push_back(iy);
+    dx.push_back(idx);
+    dy.push_back(idy);
+    w.push_back(0.f);
+    h.push_back(0.f);
+    life.push_back(1.f);
+    gravity.push_back(0.f);
+    alpha.push_back(1.f);
+    flags.push_back(PF_NONE);
+    type.push_back(0);
+    kind.push_back(ikind);
+
+    return { slot, generation_of_slot[slot] };
+}
+
+void Particle_Array::remove_particle(ParticleHandle h)
+{
+    // Removal is left to the next update, so indices stay valid during an update.
+    if (is_alive(h))
+        life[index_of_slot[h.slot]] = 0;
+}
+
+bool Particle_Array::is_alive(ParticleHandle h) const
+{
+    return h.slot < generation_of_slot.size() && generation_of_slot[h.slot] == h.generation;
+}
+
+size_t Particle_Array::index_of(ParticleHandle h) const
+{
+    return index_of_slot[h.slot];
+}
+
+void Particle_Array::set_bounds(float ix_min, float iy_min, float ix_max, float iy_max)
+{
+    x_min = ix_min;
+    y_min = iy_min;
+    x_max = ix_max;
+    y_max = iy_max;
+}
+
+void Particle_Array::update_particles(float dt)
+{
+    const size_t n = x.size();
+    particle_counters.particles_updated += n;
+    float *px = x.data();
+    float *py = y.data();
+    float *pdx = dx.data();
+    float *pdy = dy.data();
+    float *plife = life.data();
+    const float *pgravity = gravity.data();
+    const uint8_t *pflags = flags.data();
+
+    if (gx != 0 || gy != 0) {
+        const float gx_dt = gx * dt;
+        const float gy_dt = gy * dt;
+        for (size_t i = 0; i < n; i++) {
+            pdx[i] += pgravity[i] * gx_dt;
+            pdy[i] += pgravity[i] * gy_dt;
+        }
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        px[i] += pdx[i] * dt;
+        py[i] += pdy[i] * dt;
+    }
+
+    // Kinds may add particles, which only get updated from the next frame on.
+    for (size_t i = 0; i < n; i++) {
+        if (kind[i])
+            kind[i]->update(*this, i, dt);
+    }
+
+    px = x.data();
+    py = y.data();
+    plife = life.data();
+    pflags = flags.data();
+    for (size_t i = 0; i < n; i++) {
+        const bool outside = (px[i] < x_min) | (px[i] > x_max) | (py[i] < y_min) | (py[i] > y_max);
+        const bool cull = outside & ((pflags[i] & PF_CULL) != 0);
+        plife[i] = cull ? 0.f : plife[i];
+    }
+
+    size_t i = 0;
+    while (i < x.size()) {
+        if (life[i] <= 0)
+            remove_at(i);
+        else
+            i++;
+    }
+}
+
+void Particle_Array::draw_particles()
+{
+    for (size_t i = 0; i < x.size(); i++) {
+        if (kind[i])
+            kind[i]->draw(*this, i);
+    }
+}
+
+void Particle_Array::remove_particles()
+{
+    while (!x.empty())
+        remove_at(x.size() - 1);
+}
+
+void Particle_Array::remove_at(size_t i)
+{
+    if (kind[i])
+        kind[i]->remove(*this, i);
+
+    // Move the last particle into the hole
+    const size_t last = x.size() - 1;
+    const uint32_t slot = slot_of_index[i];
+    const uint32_t last_slot = slot_of_index[last];
+
+    auto move_last = [i](auto &field) {
+        field[i] = field.back();
+        field.pop_back();
+    };
+    move_last(x);
+    move_last(y);
+    move_last(dx);
+    move_last(dy);
+    move_last(w);
+    move_last(h);
+    move_last(life);
+    move_last(gravity);
+    move_last(alpha);
+    move_last(flags);
+    move_last(type);
+    move_last(kind);
+    move_last(slot_of_index);
+
+    if (i != last)
+        index_of_slot[last_slot] = static_cast<uint32_t>(i);
+    generation_of_slot[slot]++;
+    free_slots.push_back(slot);
+}
+
+//=====   Obstacle Grid class   =============================================================//
+
+void Obstacle_Grid::Bucket::add(Modifier *o)
+{
+    obstacles.push_back(o);
+    x1.push_back(o->x1);
+    y1.push_back(o->y1);
+    x2.push_back(o->x2);
+    y2.push_back(o->y2);
+}
+
+void Obstacle_Grid::Bucket::remove(Modifier *o)
+{
+    auto it = std::find(obstacles.begin(), obstacles.end(), o);
+    if (it == obstacles.end())
+        return;
+
+    const size_t i = it - obstacles.begin();
+    obstacles[i] = obstacles.back();
+    x1[i] = x1.back();
+    y1[i] = y1.back();
+    x2[i] = x2.back();
+    y2[i] = y2.back();
+    obstacles.pop_back();
+    x1.pop_back();
+    y1.pop_back();
+    x2.pop_back();
+    y2.pop_back();
+}
+
+void Obstacle_Grid::Bucket::update(const Modifier *o)
+{
+    auto it = std::find(obstacles.begin(), obstacles.end(), o);
+    if (it == obstacles.end())
+        return;
+
+    const size_t i = it - obstacles.begin();
+    x1[i] = o->x1;
+    y1[i] = o->y1;
+    x2[i] = o->x2;
+    y2[i] = o->y2;
+}
+
+void Obstacle_Grid::Bucket::clear()
+{
+    obstacles.clear();
+    x1.clear();
+    y1.clear();
+    x2.clear();
+    y2.clear();
+}
+
+Obstacle_Grid::Obstacle_Grid(float icell_size, unsigned int inr_of_buckets)
+    : cell_size(icell_size)
+    , nr_of_buckets(inr_of_buckets)
+{
+}
+
+void Obstacle_Grid::clear()
+{
+    for (auto &layer : layers) {
+        for (auto &b : layer.buckets)
+            b.clear();
+        layer.large_obstacles.clear();
+    }
+}
+
+int Obstacle_Grid::cell(float v) const
+{
+    return static_cast<int>(std::floor(v / cell_size));
+}
+
+size_t Obstacle_Grid::bucket_index(int cx, int cy) const
+{
+    const auto hash = static_cast<unsigned int>(cx) * 73856093u ^ static_cast<unsigned int>(cy) * 19349663u;
+    return hash % nr_of_buckets;
+}
+
+size_t Obstacle_Grid::layer_index(uint32_t category)
+{
+    for (size_t i = 0; i < layers.size(); i++) {
+        if (layers[i].category == category)
+            return i;
+    }
+    layers.push_back({category, std::vector<Bucket>(nr_of_buckets), Bucket()});
+    return layers.size() - 1;
+}
+
+void Obstacle_Grid::covered_cells(const Modifier *o, int &cx1, int &cy1, int &cx2, int &cy2) const
+{
+    cx1 = cell(o->x1);
+    cy1 = cell(o->y1);
+    cx2 = cell(o->x2);
+    cy2 = cell(o->y2);
+}
+
+bool Obstacle_Grid::is_large(const Modifier *o)
+{
+    return (o->cx2 - o->cx1 + 1) * (o->cy2 - o->cy1 + 1) > MAX_CELLS_PER_OBSTACLE;
+}
+
+void Obstacle_Grid::insert(Modifier *o)
+{
+    const Particle *p = o->p;
+    o->x1 = p->x - p->w / 2;
+    o->y1 = p->y - p->h / 2;
+    o->x2 = p->x + p->w / 2;
+    o->y2 = p->y + p->h / 2;
+    covered_cells(o, o->cx1, o->cy1, o->cx2, o->cy2);
+    o->layer = layer_index(p->category);
+
+    Layer &layer = layers[o->layer];
+    if (is_large(o)) {
+        layer.large_obstacles.add(o);
+        return;
+    }
+    for (int cy = o->cy1; cy <= o->cy2; cy++) {
+        for (int cx = o->cx1; cx <= o->cx2; cx++) {
+            // Cells of the obstacle may share a bucket, store it there only once. remove() and
+            // update() rely on that, and query() would report a second copy.
+            Bucket &b = layer.buckets[bucket_index(cx, cy)];
+            if (std::find(b.obstacles.begin(), b.obstacles.end(), o) == b.obstacles.end())
+                b.add(o);
+        }
+    }
+}
+
+void Obstacle_Grid::remove(Modifier *o)
+{
+    Layer &layer = layers[o->layer];
+    if (is_large(o)) {
+        layer.large_obstacles.remove(o);
+        return;
+    }
+    for (int cy = o->cy1; cy <= o->cy2; cy++) {
+        for (int cx = o->cx1; cx <= o->cx2; cx++)
+            layer.buckets[bucket_index(cx, cy)].remove(o);
+    }
+}
+
+void Obstacle_Grid::update(Modifier *o)
+{
+    const Particle *p = o->p;
+    if (p->category != layers[o->layer].category) {
+        remove(o);
+        insert(o);
+        return;
+    }
+
+    const float x1 = p->x - p->w / 2, y1 = p->y - p->h / 2;
+    const float x2 = p->x + p->w / 2, y2 = p->y + p->h / 2;
+    if (x1 == o->x1 && y1 == o->y1 && x2 == o->x2 && y2 == o->y2)
+        return;
+
+    int cx1, cy1, cx2, cy2;
+    o->x1 = x1;
+    o->y1 = y1;
+    o->x2 = x2;
+    o->y2 = y2;
+    covered_cells(o, cx1, cy1, cx2, cy2);
+    if (cx1 != o->cx1 || cy1 != o->cy1 || cx2 != o->cx2 || cy2 != o->cy2) {
+        remove(o);
+        insert(o);
+        return;
+    }
+
+    // Still in the same buckets, only the packed boxes change
+    Layer &layer = layers[o->layer];
+    if (is_large(o)) {
+        layer.large_obstacles.update(o);
+        return;
+    }
+    for (int cy = o->cy1; cy <= o->cy2; cy++) {
+        for (int cx = o->cx1; cx <= o->cx2; cx++)
+            layer.buckets[bucket_index(cx, cy)].update(o);
+    }
+}
+
+void Obstacle_Grid::query(float x1,
+                          float y1,
+                          float x2,
+                          float y2,
+                          uint32_t categories,
+                          std::vector<Modifier *> &result,
+                          unsigned long &tests) const
+{
+    constexpr size_t BLOCK_SIZE = 64; // Boxes tested per call
+    uint32_t hits[BLOCK_SIZE];
+
+    // Collects the obstacles of b whose box overlaps the query box, and which pass accept(o)
+    auto collect = [&](const Bucket &b, auto accept) {
+        const size_t n = b.obstacles.size();
+        tests += n;
+        for (size_t start = 0; start < n; start += BLOCK_SIZE) {
+            const Box_Bounds bounds {&b.x1[start], &b.y1[start], &b.x2[start], &b.y2[start]};
+            const size_t count = std::min(BLOCK_SIZE, n - start);
+            const size_t nr_of_hits = find_overlapping_boxes(bounds, count, x1, y1, x2, y2, hits);
+            for (size_t i = 0; i < nr_of_hits; i++) {
+                Modifier *o = b.obstacles[start + hits[i]];
+                if (accept(o))
+                    result.push_back(o);
+            }
+        }
+    };
+
+    result.clear();
+    const int cx1 = cell(x1), cy1 = cell(y1), cx2 = cell(x2), cy2 = cell(y2);
+    for (const Layer &layer : layers) {
+        if (!(layer.category & categories))
+            continue;
+
+        collect(layer.large_obstacles, [](const Modifier *) { return true; });
+
+        // An obstacle is reported only from the first cell it shares with the box, which also
+        // skips the obstacles of other cells that hash to the same bucket.
+        for (int cy = cy1; cy <= cy2; cy++) {
+            for (int cx = cx1; cx <= cx2; cx++) {
+                collect(layer.buckets[bucket_index(cx, cy)], [=](const Modifier *o) {
+                    return cx == std::max(o->cx1, cx1) && cy == std::max(o->cy1, cy1) && cx <= o->cx2 && cy <= o->cy2;
+                });
+            }
+        }
+    }
+}
+
+//=====   Gravity Field class   =============================================================//
+
+void Gravity_Field::Sources::add(float sx, float sy, float sgx, float sgy)
+{
+    x.push_back(sx);
+    y.push_back(sy);
+    gx.push_back(sgx);
+    gy.push_back(sgy);
+}
+
+void Gravity_Field::Sources::resize(size_t n)
+{
+    x.resize(n);
+    y.resize(n);
+    gx.resize(n);
+    gy.resize(n);
+}
+
+void Gravity_Field::Sources::clear()
+{
+    resize(0);
+}
+
+void Gravity_Field::set_far_field(float icell_size, size_t min_sources)
+{
+    far_field_cell_size = std::max(icell_size, 0.f);
+    far_field_min_sources = min_sources;
+}
+
+void Gravity_Field::gather(const std::vector<Particle *> &sources)
+{
+    constant_gx = constant_gy = 0.f;
+    points.clear();
+    lines.clear();
+    for (const Particle *s : sources) {
+        switch (s->g_type) {
+        case GravityType::Constant:
+            constant_gx += s->gx;
+            constant_gy += s->gy;
+            break;
+        case GravityType::Point: points.add(s->x, s->y, s->gx, s->gy); break;
+        case GravityType::Line: lines.add(s->x, s->y, s->gx, s->gy); break;
+        case GravityType::None: break;
+        }
+    }
+
+    use_far_field = far_field_cell_size > 0 && points.size() > 0 && points.size() >= far_field_min_sources;
+    if (use_far_field)
+        build_far_field();
+}
+
+void Gravity_Field::build_far_field()
+{
+    const size_t n = points.size();
+    const auto [x_min, x_max] = std::minmax_element(points.x.begin(), points.x.end());
+    const auto [y_min, y_max] = std::minmax_element(points.y.begin(), points.y.end());
+    grid_x = *x_min;
+    grid_y = *y_min;
+
+    // Grow the cells when the sources are spread too far for the number of cells
+    cell_size = far_field_cell_size;
+    float nr_of_columns, nr_of_rows;
+    for (;;) {
+        nr_of_columns = std::floor((*x_max - grid_x) / cell_size) + 1;
+        nr_of_rows = std::floor((*y_max - grid_y) / cell_size) + 1;
+        if (nr_of_columns * nr_of_rows <= MAX_FAR_FIELD_CELLS)
+            break;
+        cell_size *= 2;
+    }
+    columns = static_cast<int>(nr_of_columns);
+    rows = static_cast<int>(nr_of_rows);
+    const size_t nr_of_cells = static_cast<size_t>(columns) * rows;
+
+    // Sort the sources by cell, with a counting sort
+    source_cell.resize(n);
+    cell_start.assign(nr_of_cells + 1, 0);
+    for (size_t i = 0; i < n; i++) {
+        const int cx = std::min(columns - 1, static_cast<int>((points.x[i] - grid_x) / cell_size));
+        const int cy = std::min(rows - 1, static_cast<int>((points.y[i] - grid_y) / cell_size));
+        source_cell[i] = static_cast<uint32_t>(cy * columns + cx);
+        cell_start[source_cell[i] + 1]++;
+    }
+    for (size_t c = 0; c < nr_of_cells; c++)
+        cell_start[c + 1] += cell_start[c];
+
+    // Placing a source moves the start of its cell up, so afterwards each start is shifted back
+    std::swap(points, unsorted);
+    points.resize(n);
+    for (size_t i = 0; i < n; i++) {
+        const size_t j = cell_start[source_cell[i]]++;
+        points.x[j] = unsorted.x[i];
+        points.y[j] = unsorted.y[i];
+        points.gx[j] = unsorted.gx[i];
+        points.gy[j] = unsorted.gy[i];
+    }
+    for (size_t c = nr_of_cells; c > 0; c--)
+        cell_start[c] = cell_start[c - 1];
+    cell_start[0] = 0;
+
+    // One source per cell, at the centre of its sources weighted by their strength
+    cells.clear();
+    for (size_t c = 0; c < nr_of_cells; c++) {
+        float sum_gx = 0.f, sum_gy = 0.f, weight = 0.f, wx = 0.f, wy = 0.f;
+        for (size_t i = cell_start[c]; i < cell_start[c + 1]; i++) {
+            const float w = std::abs(points.gx[i]) + std::abs(points.gy[i]);
+            sum_gx += points.gx[i];
+            sum_gy += points.gy[i];
+            weight += w;
+            wx += w * points.x[i];
+            wy += w * points.y[i];
+        }
+        if (weight > 0)
+            cells.add(wx / weight, wy / weight, sum_gx, sum_gy);
+        else
+            cells.add(grid_x + (c % columns + 0.5f) * cell_size, grid_y + (c / columns + 0.5f) * cell_size, 0.f, 0.f);
+    }
+}
+
+void Gravity_Field::add_pull(const Sources &s, size_t begin, size_t end, float px, float py, float &ax, float &ay)
+{
+    if (begin < end) {
+        const Gravity_Sources packed {&s.x[begin], &s.y[begin], &s.gx[begin], &s.gy[begin]};
+        add_point_gravity(packed, end - begin, px, py, ax, ay);
+    }
+}
+
+void Gravity_Field::apply(Particle *p, float dt) const
+{
+    // Calculate effect of gravity sources on this particle, a source does not pull itself.
+    float ax = constant_gx, ay = constant_gy;
+    if (p->grav_source != Particle::NO_GRAV_SOURCE && p->g_type == GravityType::Constant) {
+        ax -= p->gx;
+        ay -= p->gy;
+    }
+
+    if (!use_far_field) {
+        add_pull(points, 0, points.size(), p->x, p->y, ax, ay);
+    } else {
+        // The cells next to the particle pull source by source, the others as a whole. Cells
+        // are stored row by row, so the cells in between the nearby ones are a single range.
+        const float cx = std::clamp(std::floor((p->x - grid_x) / cell_size), 0.f, columns - 1.f);
+        const float cy = std::clamp(std::floor((p->y - grid_y) / cell_size), 0.f, rows - 1.f);
+        const int c1 = std::max(static_cast<int>(cx) - 1, 0), c2 = std::min(static_cast<int>(cx) + 1, columns - 1);
+        const int r1 = std::max(static_cast<int>(cy) - 1, 0), r2 = std::min(static_cast<int>(cy) + 1, rows - 1);
+        size_t far = 0;
+        for (int r = r1; r <= r2; r++) {
+            const size_t first = static_cast<size_t>(r) * columns + c1;
+            const size_t last = static_cast<size_t>(r) * columns + c2 + 1;
+            add_pull(points, cell_start[first], cell_start[last], p->x, p->y, ax, ay);
+            add_pull(cells, far, first, p->x, p->y, ax, ay);
+            far = last;
+        }
+        add_pull(cells, far, cells.size(), p->x, p->y, ax, ay);
+    }
+
+    for (size_t i = 0; i < lines.size(); i++) {
+        const float Dx = lines.x[i] - p->x;
+        const float Dy = lines.y[i] - p->y;
+        if (Dx != 0)
+            ax += lines.gx[i] / (Dx * Dx * SGN(Dx));
+        if (Dy != 0)
+            ay += lines.gy[i] / (Dy * Dy * SGN(Dy));
+    }
+
+    p->dx += p->gravity * ax * dt;
+    p->dy += p->gravity * ay * dt;
 }
@@ -6,14 +6,60 @@
 
 #pragma once
 
+#include <atomic>
+#include <cstddef>
 #include <cstdint>
-#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
-// Random float in [0,1)
-inline float randf()
-{
-    return static_cast<float>(std::rand() & 1023) / 1024.0f;
-}
+//=====   Random class   ====================================================================//
+
+/*
+  Small and fast xorshift64* random number generator. Each Particle_System owns one, so there
+  is no shared state between systems and a run can be reproduced from its seed. Copying a
+  generator clones its state, split() derives an independent generator.
+*/
+class Random {
+public:
+    explicit Random(uint64_t seed = 1) { this->seed(seed); }
+
+    void seed(uint64_t seed)
+    {
+        // Scramble the seed with splitmix64, since the state may never be zero
+        seed += 0x9E3779B97F4A7C15ull;
+        seed = (seed ^ (seed >> 30)) * 0xBF58476D1CE4E5B9ull;
+        seed = (seed ^ (seed >> 27)) * 0x94D049BB133111EBull;
+        state = (seed ^ (seed >> 31)) | 1;
+    }
+
+    // Random 32-bit integer
+    uint32_t next()
+    {
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        return static_cast<uint32_t>((state * 0x2545F4914F6CDD1Dull) >> 32);
+    }
+
+    // Random float in [0,1)
+    float randf() { return static_cast<float>(next() >> 8) * (1.f / 16777216.f); }
+
+    // Fills the buffer with random floats in [0,1)
+    void fill(float *values, size_t n)
+    {
+        for (size_t i = 0; i < n; i++)
+            values[i] = randf();
+    }
+
+    [[nodiscard]] Random split() { return Random((static_cast<uint64_t>(next()) << 32) | next()); }
+
+private:
+    uint64_t state = 1;
+};
 
 // Gravitation types
 enum class GravityType : uint8_t {
@@ -26,13 +72,26 @@ enum class GravityType : uint8_t {
 // Obstacle types
 enum class ObstacleType : uint8_t {
     None,
-    Rect
+    Rect,
+    Grid // Only for a Particle_Grid
+};
+
+// Statistics gathered by all particle systems together, for profiling
+struct Particle_Counters {
+    unsigned long particles_updated = 0;
+    unsigned long collision_tests = 0;
 };
 
+extern Particle_Counters particle_counters;
+
+enum DrawLayer : uint8_t; // See base.h
+
 // Empty class declarations
+class Particle_System_Base;
 class Particle_System;
 class Modifier;
 class ParticleList;
+class Worker_Pool;
 
 //=====   Particle class   ==================================================================//
 
@@ -44,6 +103,8 @@ class ParticleList;
   give it to the system with Particle_System::add_particle(Particle *p);. From that time on
   you should not be using the pointer to your particle, nor try to delete it. The system will
   take care of the particle now.
+  Preferably, let the system create the particle from its pool with
+  Particle_System::add_particle<MyParticle>(arguments...);, which avoids a heap allocation.
   You might want to call Particle_System::remove_particle(Particle *p) to remove the particle
   from the system, but you'll have to be really sure that the particle still exists.
 
@@ -55,12 +116,66 @@ class ParticleList;
    collision(Particle *p);  -> when a collision occurs between this particle and *p.
    remove();                -> just before the particle is deleted.
 
-  Also, the system checks the g_type and o_type parameters after each update and will adapt
-  automatically to get the expected result.
+  update_particles(dt) works in phases: first gravity is applied to all particles, then
+  collisions are resolved, all particles are moved, update() is called on each of them and
+  finally the particles whose life has run out are removed.
+  Those particles are removed together: first they are all taken out of the system, then
+  remove() is called on each of them, the most recently added or woken first, and finally
+  they are all deleted. That is also the order of update(), except for the particles that
+  are updated in parallel or per registered type. Removing a particle during
+  update_particles(), also from remove(), only sets its life to 0, so it is removed at the
+  end of this update or, from remove(), the next one.
+  A sleeping particle whose life is set to 0 directly is only removed once it wakes.
+  The system reads g_type and o_type when the particle is added. To change them afterwards, use
+  set_gravity_type() and set_obstacle_type(): the system only keeps track of the particles that
+  changed, and applies the changes at the start of the next update_particles(). Obstacles are
+  looked up by their position at the start of the collision phase.
+
+  Which obstacles a particle collides with can be limited with category and collides_with: it
+  only tests the obstacles whose category shares a bit with its collides_with. Obstacles are
+  kept apart per category, so the obstacles it does not collide with are not tested at all.
+
+  Collisions are normally found by testing for overlap once per update, which lets a fast
+  particle pass through a thin obstacle. When fast_mover is set as well as
+  affected_by_obstacle, the particle is instead swept along its path: it is moved to the
+  earliest hit, bounces, and moves on for the rest of dt. Obstacles hit at the same time are
+  all reported, with a single bounce. Obstacles that it already overlaps, like one that moved
+  onto it, bounce it as if it were not a fast mover.
+
+  A particle that has nothing to do can call sleep(): it is left out of update_particles()
+  until it is woken by wake(), by another particle colliding with it, or when the time given
+  to sleep() has passed. A sleeping particle is still drawn and still acts as an obstacle, but
+  it does not move, and gravity does not pull it. Only particles that have been added to a
+  system can sleep, so call sleep() from initialize() or update(), not the constructor.
+
+  Types with many particles can be registered with register_type<MyParticle>(). Particles
+  created with add_particle<MyParticle>() are then updated and drawn per type, by a loop that
+  calls MyParticle::update() and MyParticle::draw() directly instead of through the vtable.
+  Particles of other types are updated and drawn first, in list order, followed by each
+  registered type in the order it was registered. Parallel updates are not grouped.
+
+  draw_particles(alpha) draws each particle at prev_x + (x - prev_x) * alpha, where prev_x is
+  its position before the last update_particles(dt), so the simulation can run at a fixed rate
+  independent of the frame rate. While draw() is called, x and y hold that position. Each
+  particle is drawn on its layer, which draw_particles() sets before calling draw().
+
+  After Particle_System::set_worker_threads(n), gravity, collision detection and integration
+  are spread over n threads. The collision() calls are still made one at a time, in the same
+  order as without threads. Particles that set parallel_update are also updated on the worker
+  threads, before the other particles. Their update() may only change the particle itself, add
+  particles or remove itself; it must not use system->random. Particles are added when all
+  parallel updates are done, and removing a particle from within update_particles() only sets
+  its life to 0.
+  A particle that owns a system of its own can let it use the threads of its system with
+  share_worker_threads(*system), instead of starting more threads. Such a system must not be
+  updated from a parallel update.
 */
 
 class Particle {
 public:
+    static constexpr size_t NO_GRAV_SOURCE = SIZE_MAX;
+    static constexpr size_t NO_TYPE_GROUP = SIZE_MAX;
+
     Particle();
     virtual ~Particle() = default;
 
@@ -70,19 +185,34 @@ public:
     virtual void collision(Particle *p) {};
     virtual void remove() {};
 
+    void set_gravity_type(GravityType type);
+    void set_obstacle_type(ObstacleType type);
+
+    void sleep(float time = 0.f); // Sleep until woken, or at most time seconds when time > 0
+    void wake();
+
+    // The system as a Particle_System, nullptr when the particle is in a system of another type
+    [[nodiscard]] Particle_System *particle_system() const;
+    [[nodiscard]] bool is_sleeping() const { return sleeping; }
+
     float x = 0.f, y = 0.f, dx = 0.f, dy = 0.f;
     float life = 1.f; // If life <= 0 then the particle will be removed.
     float gravity = 0.f; // Amount of influence from gravity sources.
     bool affected_by_obstacle = false;
+    bool fast_mover = false; // Sweep for obstacles instead of testing for overlap, see above.
+    bool parallel_update = false; // update() may run on a worker thread, see above.
+    uint32_t category = 1; // Collision category bits of this particle as an obstacle
+    uint32_t collides_with = ~0u; // Categories of the obstacles this particle collides with
 
     int type = 0; // Can be used to identify the particle, 0 by default.
     float w = 0.f, h = 0.f; // Width, Height
     float r = 0.f; // Radius
     float gx = 0.f, gy = 0.f; // G-Force
-    GravityType g_type = GravityType::None; // Gravity type
-    ObstacleType o_type = ObstacleType::None; // Obstacle type
+    DrawLayer layer; // Layer that draw() draws on, DL_OBJECTS by default
+    GravityType g_type = GravityType::None; // Gravity type, see set_gravity_type()
+    ObstacleType o_type = ObstacleType::None; // Obstacle type, see set_obstacle_type()
 
-    Particle_System *system = nullptr; // Can be used to add additional particles to the system.
+    Particle_System_Base *system = nullptr; // Can be used to add additional particles to the system.
 
     /*
       The following variables are used by the particle system
@@ -91,10 +221,127 @@ public:
     */
     Particle *prev = nullptr;
     Particle *next = nullptr;
+    Particle *prev_awake = nullptr;
+    Particle *next_awake = nullptr;
+    bool sleeping = false;
+    bool removing = false; // Being removed with the other dead particles
+    double wake_time = 0.0; // For sleep(time), 0 when sleeping until woken
     Modifier *obstacle = nullptr;
-    Modifier *grav_source = nullptr;
+    size_t grav_source = NO_GRAV_SOURCE; // Index in the gravity sources of the system
+    size_t type_group = NO_TYPE_GROUP; // Registered type of the particle, see register_type()
+    bool type_changed = false; // Waiting for the system to apply a new g_type or o_type
     // std::vector<Particle*> colliding_particles;
     bool colliding = false;
+    float prev_x = 0.f, prev_y = 0.f; // Position before the last update, for draw_particles(alpha)
+    size_t pool_size = 0; // Size of the allocation in the system's pool, 0 when created with new.
+};
+
+//=====   Particle Grid class   =============================================================//
+
+/*
+  An obstacle made of a fixed grid of equally sized cells, like a field of bricks. Only the solid
+  cells are obstacles, and looking up the cells near a particle is a direct index, so the number
+  of cells hardly matters. The grid is a single particle: when p hits a cell, p->collision() is
+  called with the grid, followed by cell_collision(cell, p) on the grid. Cells are numbered
+  row by row, see cell_index().
+
+  Like a particle, a cell removed with remove_cell() during update_particles() stays solid until
+  the removal phase, which calls cell_removed(cell) for each of them before the dead particles
+  are removed.
+*/
+class Particle_Grid : public Particle {
+public:
+    Particle_Grid(float x_min, float y_min, int columns, int rows, float cell_w, float cell_h);
+
+    virtual void cell_collision(int cell, Particle *p) {};
+    virtual void cell_removed(int cell) {};
+
+    [[nodiscard]] int cell_index(int column, int row) const { return row * columns + column; }
+    [[nodiscard]] bool is_solid(int cell) const { return solid[cell] != EMPTY; }
+    void set_solid(int cell, bool is_solid) { solid[cell] = is_solid ? SOLID : EMPTY; }
+    void remove_cell(int cell);
+    [[nodiscard]] bool is_removing(int cell) const { return solid[cell] == REMOVING; }
+
+    // Centre of a cell
+    [[nodiscard]] float cell_x(int column) const { return x - w / 2 + (column + 0.5f) * cell_w; }
+    [[nodiscard]] float cell_y(int row) const { return y - h / 2 + (row + 0.5f) * cell_h; }
+
+    // Range of cells overlapping the box, returns false when there are none.
+    bool cells_in(float x1, float y1, float x2, float y2, int &c1, int &r1, int &c2, int &r2) const;
+
+    const int columns, rows;
+    const float cell_w, cell_h;
+
+private:
+    friend class Particle_System_Base; // For remove_queued_cells()
+
+    enum : uint8_t { EMPTY, SOLID, REMOVING };
+
+    void remove_queued_cells();
+
+    std::vector<uint8_t> solid;
+    std::vector<int> removed_cells; // Cells waiting for the removal phase
+};
+
+//=====   Particle Pool class   =============================================================//
+
+/*
+  Allocator owned by each Particle_System, for its particles and modifiers. Blocks are carved
+  from large chunks and recycled through a free list per size class, so once the chunks have
+  been allocated, adding and removing particles does not touch the heap. Modifiers all fall in
+  the smallest size class. Blocks larger than the largest size class come from the heap.
+
+  reset() releases all blocks at once, which is how a system drops all its particles.
+*/
+
+struct Pool_Stats {
+    unsigned long heap_allocations = 0; // Chunks and large blocks allocated from the heap
+    unsigned long allocations = 0;
+    unsigned long frees = 0;
+};
+
+class Particle_Pool {
+public:
+    static constexpr size_t MIN_BLOCK_SIZE = 64;
+    static constexpr size_t MAX_BLOCK_SIZE = 1024;
+
+    Particle_Pool() = default;
+    ~Particle_Pool();
+    Particle_Pool(const Particle_Pool &) = delete;
+    Particle_Pool &operator=(const Particle_Pool &) = delete;
+
+    [[nodiscard]] void *allocate(size_t size);
+    void free(void *block, size_t size);
+    void reset();
+
+    [[nodiscard]] const Pool_Stats &stats() const { return pool_stats; }
+    [[nodiscard]] static Pool_Stats total_stats(); // Summed over all pools
+
+private:
+    static constexpr size_t NR_OF_SIZE_CLASSES = 5; // 64, 128, 256, 512 and 1024 bytes
+    static constexpr size_t CHUNK_SIZE = 16384;
+
+    struct Free_Block {
+        Free_Block *next;
+    };
+
+    struct Size_Class {
+        Free_Block *free_list = nullptr;
+        std::vector<char *> chunks;
+        size_t chunk = 0; // Chunk currently being carved
+        size_t used = 0; // Bytes carved from the current chunk
+    };
+
+    [[nodiscard]] static size_t size_class(size_t size);
+
+    Size_Class size_classes[NR_OF_SIZE_CLASSES];
+    std::vector<void *> large_blocks;
+    Pool_Stats pool_stats;
+
+    // Pools of different systems may be used on different threads at the same time
+    static std::atomic<unsigned long> total_heap_allocations;
+    static std::atomic<unsigned long> total_allocations;
+    static std::atomic<unsigned long> total_frees;
 };
 
 //=====   Particle System class   ===========================================================//
@@ -107,29 +354,484 @@ public:
     }
 
     Particle *p;
-    Modifier *prev = nullptr;
-    Modifier *next = nullptr;
+    size_t index = 0; // Index in the obstacles of the system
+
+    // Used by the Obstacle_Grid
+    size_t layer = 0; // Layer for the category of p
+    int cx1 = 0, cy1 = 0, cx2 = -1, cy2 = -1; // Covered cells
+    float x1 = 0.f, y1 = 0.f, x2 = 0.f, y2 = 0.f; // Bounding box
+};
+
+/*
+  Uniform grid used as broad phase for collisions with obstacles. The cells are hashed into a
+  fixed number of buckets, so the grid covers any coordinates. An obstacle is stored in every
+  bucket its bounding box touches, except very large obstacles, which are always tested.
+  Each bucket also keeps the bounding boxes of its obstacles in packed arrays, so a query tests
+  them many at a time with find_overlapping_boxes().
+  There is a separate layer of buckets for each collision category, and a query only looks in
+  the layers of the categories it asks for. A change of category is picked up by update().
+  Queries do not change the grid, so they can be made from several threads at once.
+*/
+class Obstacle_Grid {
+public:
+    Obstacle_Grid(float cell_size = 32.f, unsigned int nr_of_buckets = 1024);
+
+    void clear();
+    void insert(Modifier *o);
+    void remove(Modifier *o);
+    void update(Modifier *o);
+
+    // Collects each obstacle whose category shares a bit with categories, and whose bounding box
+    // overlaps the given box, once. tests is increased by the number of bounding boxes tested.
+    void query(float x1,
+               float y1,
+               float x2,
+               float y2,
+               uint32_t categories,
+               std::vector<Modifier *> &result,
+               unsigned long &tests) const;
+
+private:
+    static constexpr int MAX_CELLS_PER_OBSTACLE = 64;
+
+    struct Bucket {
+        std::vector<Modifier *> obstacles;
+        std::vector<float> x1, y1, x2, y2; // Bounding boxes of the obstacles
+
+        void add(Modifier *o);
+        void remove(Modifier *o);
+        void update(const Modifier *o);
+        void clear();
+    };
+
+    // The obstacles of one category
+    struct Layer {
+        uint32_t category;
+        std::vector<Bucket> buckets;
+        Bucket large_obstacles;
+    };
+
+    [[nodiscard]] int cell(float v) const;
+    [[nodiscard]] size_t bucket_index(int cx, int cy) const;
+    [[nodiscard]] size_t layer_index(uint32_t category);
+    void covered_cells(const Modifier *o, int &cx1, int &cy1, int &cx2, int &cy2) const;
+    [[nodiscard]] static bool is_large(const Modifier *o);
+
+    float cell_size;
+    unsigned int nr_of_buckets;
+    std::vector<Layer> layers;
 };
 
-class Particle_System {
+/*
+  The gravity sources of a system, gathered into packed arrays at the start of each update, so
+  the pull of the Point sources on a particle is summed many at a time with add_point_gravity().
+  The Constant sources are added up once.
+
+  With a far field set and at least min_sources Point sources, the Point sources are sorted
+  into a grid of cells. The sources in the cell of the particle and the 8 cells around it pull
+  one by one; every other cell pulls as one source with the summed strength of its sources, at
+  their centre weighted by strength. That approximates the pull of distant sources, but the
+  cost per particle grows with the number of cells instead of the number of sources.
+  apply() does not change the field, so it can be called from several threads at once.
+*/
+class Gravity_Field {
 public:
-    Particle_System();
-    ~Particle_System();
+    void set_far_field(float cell_size, size_t min_sources);
+
+    void gather(const std::vector<Particle *> &sources);
+    void apply(Particle *p, float dt) const;
+
+private:
+    static constexpr size_t MAX_FAR_FIELD_CELLS = 4096;
+
+    struct Sources {
+        std::vector<float> x, y, gx, gy;
+
+        void add(float sx, float sy, float sgx, float sgy);
+        void resize(size_t n);
+        void clear();
+        [[nodiscard]] size_t size() const { return x.size(); }
+    };
+
+    void build_far_field();
+    static void add_pull(const Sources &s, size_t begin, size_t end, float px, float py, float &ax, float &ay);
+
+    float constant_gx = 0.f, constant_gy = 0.f; // Sum of the Constant sources
+    Sources points; // Sorted by cell when the far field is used
+    Sources lines;
+
+    // Far field
+    float far_field_cell_size = 0.f; // 0 when it is not used
+    size_t far_field_min_sources = 0;
+    bool use_far_field = false;
+    float grid_x = 0.f, grid_y = 0.f, cell_size = 0.f; // Top left corner and size of the cells
+    int columns = 0, rows = 0;
+    std::vector<size_t> cell_start; // Index in points of the first source of each cell, and the end
+    std::vector<uint32_t> source_cell;
+    Sources cells; // One source per cell
+    Sources unsorted;
+};
+
+// Features a particle system can be built with, see Particle_System_T
+enum SystemFeatures : unsigned {
+    SF_NONE = 0, // Particles are only moved and updated
+    SF_GRAVITY = 1 << 0, // Gravity sources
+    SF_OBSTACLES = 1 << 1, // Obstacles and collisions with them
+    SF_ALL = SF_GRAVITY | SF_OBSTACLES
+};
+
+/*
+  The part of a particle system that all features share: the particles and their pool, the
+  update and removal of particles, sleeping, drawing and the worker threads. Particles refer to
+  their system through this class. The phases and registries for gravity and obstacles are here
+  too, but only Particle_System_T decides whether they are used.
+*/
+class Particle_System_Base {
+public:
+    virtual ~Particle_System_Base();
 
     void add_particle(Particle *p);
     void remove_particle(Particle *p);
 
-    void draw_particles();
-    void update_particles(float dt);
+    // Creates a particle in the system's pool and adds it to the system.
+    template <typename T, typename... Args>
+    T *add_particle(Args &&...args)
+    {
+        static_assert(alignof(T) <= alignof(std::max_align_t), "Particle is over-aligned for the pool");
+        T *p = new (allocate_particle(sizeof(T))) T(std::forward<Args>(args)...);
+        p->pool_size = sizeof(T);
+        p->type_group = find_type_group(type_key<T>());
+        add_particle(p);
+        return p;
+    }
+
+    // Updates and draws the particles of type T per type, without virtual calls, see Particle.
+    template <typename T>
+    void register_type()
+    {
+        static_assert(std::is_base_of_v<Particle, T>, "Only particles can be registered");
+        if (find_type_group(type_key<T>()) == Particle::NO_TYPE_GROUP)
+            type_groups.push_back({type_key<T>(), update_group<T>, draw_group<T>, {}});
+    }
+
+    void draw_particles(float alpha = 1.f);
+    virtual void update_particles(float dt) = 0;
     void remove_particles();
 
-    void set_obstacle(Particle *p);
-    void set_grav_source(Particle *p);
+    // Alpha given to the draw_particles() call in progress
+    [[nodiscard]] float interpolation() const { return draw_alpha; }
+
+    // Apply a change of o_type or g_type right away, instead of at the next update_particles().
+    virtual void set_obstacle(Particle *p) = 0;
+    virtual void set_grav_source(Particle *p) = 0;
+
+    // Spreads updates over n threads, the calling thread included. 0 uses all cores, 1 none.
+    void set_worker_threads(unsigned int n);
+    // Uses the threads of other, as long as other does not call set_worker_threads() again.
+    void share_worker_threads(const Particle_System_Base &other);
+
+    [[nodiscard]] const Pool_Stats &pool_stats() const { return pool.stats(); }
 
     unsigned int nr_of_particles = 0;
+    Random random; // Random numbers for the particles in this system
+
+protected:
+    static constexpr size_t PARALLEL_CHUNK_SIZE = 64; // Particles per chunk of work
+
+    // A collision found by collide_with_obstacles, o is nullptr for the bounce of p itself.
+    struct Contact {
+        Particle *p;
+        Particle *o;
+        int cell; // Cell of o when it is a Particle_Grid, -1 otherwise
+        bool bounce_x, bounce_y;
+    };
+
+    // Data used by one worker thread
+    struct alignas(64) Worker_Scratch {
+        std::vector<Modifier *> nearby_obstacles;
+        unsigned long collision_tests = 0;
+    };
+
+    // Used with SF_GRAVITY
+    struct Gravity_State {
+        std::vector<Particle *> sources;
+        Gravity_Field field;
+    };
+
+    // Used with SF_OBSTACLES
+    struct Obstacle_State {
+        std::vector<Modifier *> obstacles;
+        Obstacle_Grid grid;
+        std::vector<Particle *> swept_list; // Particles with fast_mover and affected_by_obstacle
+        std::vector<Contact> swept_hits;
+        std::vector<std::vector<Contact>> chunk_contacts; // Collisions found per chunk of update_list
+    };
+
+    Particle_System_Base();
+
+    // The phases of update_particles()
+    void begin_update(float dt);
+    void apply_gravity(Gravity_State &g, float dt);
+    void resolve_collisions(Obstacle_State &o, float dt);
+    void integrate(float dt, bool skip_swept);
+    void call_updates(float dt);
+    void end_update();
+
+    // Hooks for the features
+    virtual void forget_removed(bool obstacles_removed, bool grav_sources_removed) = 0;
+    virtual void clear_features() = 0;
+
+    // Used by the features to keep their registries
+    void update_obstacle(Obstacle_State &o, Particle *p);
+    void update_grav_source(Gravity_State &g, Particle *p);
+    void forget_removed_obstacles(Obstacle_State &o);
+    static void forget_removed_grav_sources(Gravity_State &g);
 
 private:
+    friend class Particle; // For type_changed(), sleep_particle() and wake_particle()
+    friend class Particle_Grid; // For queue_cell_removals()
+
+    // The particles of one registered type, and its loops
+    struct Type_Group {
+        const void *key;
+        void (*update)(Particle *const *particles, size_t n, float dt);
+        void (*draw)(Particle *const *particles, size_t n, float alpha);
+        std::vector<Particle *> particles; // Gathered for each update and draw
+    };
+
+    // A different address for each type
+    template <typename T>
+    static const void *type_key()
+    {
+        static const char key = 0;
+        return &key;
+    }
+
+    template <typename T>
+    static void update_group(Particle *const *particles, size_t n, float dt)
+    {
+        for (size_t i = 0; i < n; i++) {
+            Particle *p = particles[i];
+            if (p->life > 0 && !p->sleeping)
+                static_cast<T *>(p)->T::update(dt);
+        }
+    }
+
+    template <typename T>
+    static void draw_group(Particle *const *particles, size_t n, float alpha)
+    {
+        for (size_t i = 0; i < n; i++)
+            draw_at(particles[i], alpha, [](Particle *p) { static_cast<T *>(p)->T::draw(); });
+    }
+
+    // Calls draw(p) on its layer, with p moved to its position at alpha between the last two updates
+    template <typename Draw>
+    static void draw_at(Particle *p, float alpha, Draw draw)
+    {
+        set_layer(p);
+        if (alpha >= 1.f) {
+            draw(p);
+            return;
+        }
+        const float x = p->x, y = p->y;
+        p->x = p->prev_x + (x - p->prev_x) * alpha;
+        p->y = p->prev_y + (y - p->prev_y) * alpha;
+        draw(p);
+        p->x = x;
+        p->y = y;
+    }
+
+    static void set_layer(const Particle *p);
+    [[nodiscard]] size_t find_type_group(const void *key) const;
+
+    void collide_with_obstacles(const Obstacle_State &o,
+                                Particle *p,
+                                Worker_Scratch &scratch,
+                                std::vector<Contact> &contacts) const;
+    void sweep_through_obstacles(Obstacle_State &o, Particle *p, float dt);
+    void report_contact(const Contact &c);
+    void type_changed(Particle *p);
+    void apply_type_changes();
+    void sleep_particle(Particle *p, float time);
+    void wake_particle(Particle *p);
+    void link_awake(Particle *p);
+    void unlink_awake(Particle *p);
+    void remove_dead_particles();
+    void queue_cell_removals(Particle_Grid *grid);
+    void update_in_parallel(float dt);
+    [[nodiscard]] void *allocate_particle(size_t size);
+    void destroy_particle(Particle *p, bool free_block);
+    [[nodiscard]] Modifier *new_modifier(Particle *p);
+    void delete_modifier(Modifier *m);
+
+    Particle_Pool pool;
+
     Particle *first_particle = nullptr;
-    Modifier *first_obstacle = nullptr;
-    Modifier *first_grav_source = nullptr;
+    Particle *first_awake = nullptr; // The particles that are not sleeping
+    std::vector<Particle *> timed_sleepers; // Sleeping particles with a wake_time
+    double clock = 0.0; // Time passed in update_particles()
+    std::vector<Particle *> changed_particles; // Particles with type_changed set
+
+    std::shared_ptr<Worker_Pool> workers; // Shared with nested systems
+    std::vector<Worker_Scratch> worker_scratch;
+    std::vector<Particle *> update_list; // Particles at the start of update_particles
+    std::vector<Particle *> parallel_list; // Particles with parallel_update
+    std::vector<Particle *> removal_list; // Dead particles, in the order of the awake list
+    std::vector<Particle_Grid *> removing_grids; // Grids with cells waiting for the removal phase
+    std::vector<Type_Group> type_groups;
+
+    float draw_alpha = 1.f;
+
+    // Used while update_particles() runs
+    bool updating = false;
+    bool in_parallel = false; // Worker threads may be calling add_particle()
+    std::mutex pending_mutex;
+    std::vector<Particle *> pending_particles;
+};
+
+/*
+  A particle system with only the features it needs, a combination of SystemFeatures. Without
+  SF_GRAVITY, g_type is ignored and nothing is pulled; without SF_OBSTACLES, o_type and
+  affected_by_obstacle are ignored and fast movers are moved like the others. The phases and
+  data of a missing feature are left out at compile time. Particle_System has all features;
+  it is a class of its own, so it can still be declared ahead, and particles in it can reach
+  it through particle_system(). The four combinations are instantiated in p_engine.cpp.
+*/
+template <unsigned Features>
+class Particle_System_T : public Particle_System_Base {
+public:
+    static constexpr bool HAS_GRAVITY = (Features & SF_GRAVITY) != 0;
+    static constexpr bool HAS_OBSTACLES = (Features & SF_OBSTACLES) != 0;
+
+    Particle_System_T() = default;
+    ~Particle_System_T() override;
+
+    void update_particles(float dt) override;
+    void set_obstacle(Particle *p) override;
+    void set_grav_source(Particle *p) override;
+
+    // Approximates the pull of distant Point gravity sources when there are at least min_sources,
+    // see Gravity_Field. A cell_size of 0 turns it off, which is the default.
+    template <unsigned F = Features>
+    void set_far_field_gravity(float cell_size, size_t min_sources = 256)
+    {
+        static_assert((F & SF_GRAVITY) != 0, "set_far_field_gravity() needs SF_GRAVITY");
+        gravity.field.set_far_field(cell_size, min_sources);
+    }
+
+private:
+    struct No_State {};
+
+    void forget_removed(bool obstacles_removed, bool grav_sources_removed) override;
+    void clear_features() override;
+
+    std::conditional_t<HAS_GRAVITY, Gravity_State, No_State> gravity;
+    std::conditional_t<HAS_OBSTACLES, Obstacle_State, No_State> obstacles;
+};
+
+class Particle_System : public Particle_System_T<SF_ALL> {};
+
+/*
+  Runs a particle system at a fixed rate, whatever the frame rate. Each frame, advance() runs as
+  many steps as fit in the time passed and returns the alpha to give to draw_particles(). When
+  a frame takes longer than MAX_STEPS_PER_FRAME steps, the rest of its time is dropped, so the
+  game slows down instead of taking ever more steps.
+*/
+class Fixed_Timestep {
+public:
+    static constexpr int MAX_STEPS_PER_FRAME = 8;
+
+    explicit Fixed_Timestep(float rate = 60.f) { set_rate(rate); }
+
+    void set_rate(float rate) { step = 1.f / rate; }
+    [[nodiscard]] float advance(Particle_System_Base &system, float frame_time);
+
+private:
+    float step = 1.f / 60.f;
+    float time_left = 0.f; // Time passed, but not yet simulated
+};
+
+//=====   Particle Array class   ============================================================//
+
+/*
+  A structure-of-arrays alternative to Particle_System, meant for large numbers of simple
+  particles like stars. Every field lives in its own contiguous array, so integrating and
+  culling the particles are linear scans the compiler can vectorize.
+
+  Particles are referred to by a ParticleHandle. When a particle is removed, the last particle
+  is moved into its place, so indices change. A handle stays valid until its particle is
+  removed, use index_of(handle) to look up the current index.
+
+  Particles that need custom behaviour can be given a ParticleKind. The array will call:
+
+   update(a, i, dt);  -> after integration, for each particle of this kind.
+   draw(a, i);        -> when draw_particles() has reached this particle.
+   remove(a, i);      -> just before the particle is removed.
+
+  A particle is removed when its life drops to 0 or, when it has the PF_CULL flag, when it
+  leaves the bounds set with set_bounds().
+*/
+
+class Particle_Array;
+
+class ParticleKind {
+public:
+    virtual ~ParticleKind() = default;
+
+    virtual void update(Particle_Array &a, size_t i, float dt) {};
+    virtual void draw(Particle_Array &a, size_t i) {};
+    virtual void remove(Particle_Array &a, size_t i) {};
+};
+
+struct ParticleHandle {
+    uint32_t slot = UINT32_MAX;
+    uint32_t generation = 0;
+};
+
+// Particle flags
+enum ParticleFlags : uint8_t {
+    PF_NONE = 0,
+    PF_CULL = 1 << 0 // Remove the particle when it leaves the bounds.
+};
+
+class Particle_Array {
+public:
+    Particle_Array() = default;
+    ~Particle_Array();
+
+    ParticleHandle add_particle(float x, float y, float dx, float dy, ParticleKind *kind = nullptr);
+    void remove_particle(ParticleHandle h);
+    [[nodiscard]] bool is_alive(ParticleHandle h) const;
+    [[nodiscard]] size_t index_of(ParticleHandle h) const;
+
+    void draw_particles();
+    void update_particles(float dt);
+    void remove_particles();
+
+    void set_bounds(float x_min, float y_min, float x_max, float y_max);
+
+    [[nodiscard]] size_t size() const { return x.size(); }
+
+    // Per particle fields, indexed by [0, size()).
+    std::vector<float> x, y, dx, dy;
+    std::vector<float> w, h; // Width, Height
+    std::vector<float> life; // If life <= 0 then the particle will be removed.
+    std::vector<float> gravity; // Amount of influence from gx and gy.
+    std::vector<float> alpha; // Opacity, for kinds that draw with transparency.
+    std::vector<uint8_t> flags;
+    std::vector<int> type; // Can be used to identify the particle, 0 by default.
+    std::vector<ParticleKind *> kind;
+
+    float gx = 0.f, gy = 0.f; // Constant G-Force applied to all particles
+
+private:
+    void remove_at(size_t i);
+
+    float x_min = 0.f, y_min = 0.f, x_max = 0.f, y_max = 0.f;
+
+    // Mapping between stable handles and indices
+    std::vector<uint32_t> slot_of_index;
+    std::vector<uint32_t> index_of_slot;
+    std::vector<uint32_t> generation_of_slot;
+    std::vector<uint32_t> free_slots;
 };
@@ -0,0 +1,169 @@
+/*
+ * point_gravity.cpp
+ *
+ * Implementations of the point gravity sum for each instruction set, and the choice between them.
+ */
+
+#include "point_gravity.h"
+
+#include <cmath>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define POINT_GRAVITY_X86 1
+#include <immintrin.h>
+#endif
+
+using Add_Function = void (*)(const Gravity_Sources &, size_t, float, float, float &, float &);
+
+static void add_scalar(const Gravity_Sources &s, size_t n, float px, float py, float &ax, float &ay)
+{
+    float sum_x = 0.f, sum_y = 0.f;
+    for (size_t i = 0; i < n; i++) {
+        const float Dx = s.x[i] - px, Dy = s.y[i] - py;
+        const float squares = Dx * Dx + Dy * Dy;
+        if (squares > 0) {
+            const float inv_cube = 1.f / (squares * std::sqrt(squares));
+            sum_x += s.gx[i] * inv_cube * Dx;
+            sum_y += s.gy[i] * inv_cube * Dy;
+        }
+    }
+    ax += sum_x;
+    ay += sum_y;
+}
+
+#ifdef POINT_GRAVITY_X86
+
+__attribute__((target("sse2"))) static float sum_lanes(__m128 v)
+{
+    v = _mm_add_ps(v, _mm_movehl_ps(v, v));
+    v = _mm_add_ss(v, _mm_shuffle_ps(v, v, 1));
+    return _mm_cvtss_f32(v);
+}
+
+__attribute__((target("sse2"))) static void
+add_sse(const Gravity_Sources &s, size_t n, float px, float py, float &ax, float &ay)
+{
+    const __m128 vpx = _mm_set1_ps(px), vpy = _mm_set1_ps(py);
+    const __m128 half = _mm_set1_ps(0.5f), three_halves = _mm_set1_ps(1.5f);
+    __m128 sum_x = _mm_setzero_ps(), sum_y = _mm_setzero_ps();
+
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        const __m128 Dx = _mm_sub_ps(_mm_loadu_ps(s.x + i), vpx);
+        const __m128 Dy = _mm_sub_ps(_mm_loadu_ps(s.y + i), vpy);
+        const __m128 squares = _mm_add_ps(_mm_mul_ps(Dx, Dx), _mm_mul_ps(Dy, Dy));
+
+        // 1 / sqrt(squares) to 12 bits, and one Newton-Raphson step to full precision
+        __m128 r = _mm_rsqrt_ps(squares);
+        r = _mm_mul_ps(r, _mm_sub_ps(three_halves, _mm_mul_ps(_mm_mul_ps(half, squares), _mm_mul_ps(r, r))));
+        __m128 inv_cube = _mm_mul_ps(_mm_mul_ps(r, r), r);
+        inv_cube = _mm_and_ps(inv_cube, _mm_cmpgt_ps(squares, _mm_setzero_ps()));
+
+        sum_x = _mm_add_ps(sum_x, _mm_mul_ps(_mm_mul_ps(_mm_loadu_ps(s.gx + i), inv_cube), Dx));
+        sum_y = _mm_add_ps(sum_y, _mm_mul_ps(_mm_mul_ps(_mm_loadu_ps(s.gy + i), inv_cube), Dy));
+    }
+    ax += sum_lanes(sum_x);
+    ay += sum_lanes(sum_y);
+
+    const Gravity_Sources tail = {s.x + i, s.y + i, s.gx + i, s.gy + i};
+    add_scalar(tail, n - i, px, py, ax, ay);
+}
+
+__attribute__((target("avx2,fma"))) static void
+add_avx2(const Gravity_Sources &s, size_t n, float px, float py, float &ax, float &ay)
+{
+    const __m256 vpx = _mm256_set1_ps(px), vpy = _mm256_set1_ps(py);
+    const __m256 half = _mm256_set1_ps(0.5f), three_halves = _mm256_set1_ps(1.5f);
+    __m256 sum_x = _mm256_setzero_ps(), sum_y = _mm256_setzero_ps();
+
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        const __m256 Dx = _mm256_sub_ps(_mm256_loadu_ps(s.x + i), vpx);
+        const __m256 Dy = _mm256_sub_ps(_mm256_loadu_ps(s.y + i), vpy);
+        const __m256 squares = _mm256_fmadd_ps(Dx, Dx, _mm256_mul_ps(Dy, Dy));
+
+        __m256 r = _mm256_rsqrt_ps(squares);
+        r = _mm256_mul_ps(r, _mm256_fnmadd_ps(_mm256_mul_ps(half, squares), _mm256_mul_ps(r, r), three_halves));
+        __m256 inv_cube = _mm256_mul_ps(_mm256_mul_ps(r, r), r);
+        inv_cube = _mm256_and_ps(inv_cube, _mm256_cmp_ps(squares, _mm256_setzero_ps(), _CMP_GT_OQ));
+
+        sum_x = _mm256_fmadd_ps(_mm256_mul_ps(_mm256_loadu_ps(s.gx + i), inv_cube), Dx, sum_x);
+        sum_y = _mm256_fmadd_ps(_mm256_mul_ps(_mm256_loadu_ps(s.gy + i), inv_cube), Dy, sum_y);
+    }
+    ax += sum_lanes(_mm_add_ps(_mm256_castps256_ps128(sum_x), _mm256_extractf128_ps(sum_x, 1)));
+    ay += sum_lanes(_mm_add_ps(_mm256_castps256_ps128(sum_y), _mm256_extractf128_ps(sum_y, 1)));
+
+    const Gravity_Sources tail = {s.x + i, s.y + i, s.gx + i, s.gy + i};
+    add_scalar(tail, n - i, px, py, ax, ay);
+}
+
+__attribute__((target("avx512f"))) static void
+add_avx512(const Gravity_Sources &s, size_t n, float px, float py, float &ax, float &ay)
+{
+    const __m512 vpx = _mm512_set1_ps(px), vpy = _mm512_set1_ps(py);
+    const __m512 half = _mm512_set1_ps(0.5f), three_halves = _mm512_set1_ps(1.5f);
+    __m512 sum_x = _mm512_setzero_ps(), sum_y = _mm512_setzero_ps();
+
+    // The last sources are loaded with a mask, so there is no scalar tail
+    for (size_t i = 0; i < n; i += 16) {
+        const __mmask16 lanes = n - i >= 16 ? 0xFFFF : static_cast<__mmask16>((1u << (n - i)) - 1);
+        const __m512 Dx = _mm512_sub_ps(_mm512_maskz_loadu_ps(lanes, s.x + i), vpx);
+        const __m512 Dy = _mm512_sub_ps(_mm512_maskz_loadu_ps(lanes, s.y + i), vpy);
+        const __m512 squares = _mm512_fmadd_ps(Dx, Dx, _mm512_mul_ps(Dy, Dy));
+        const __mmask16 valid = _mm512_mask_cmp_ps_mask(lanes, squares, _mm512_setzero_ps(), _CMP_GT_OQ);
+
+        // 1 / sqrt(squares) to 14 bits, and one Newton-Raphson step to full precision. Skipped
+        // sources get 0.
+        __m512 r = _mm512_maskz_rsqrt14_ps(valid, squares);
+        r = _mm512_mul_ps(r, _mm512_fnmadd_ps(_mm512_mul_ps(half, squares), _mm512_mul_ps(r, r), three_halves));
+        const __m512 inv_cube = _mm512_mul_ps(_mm512_mul_ps(r, r), r);
+
+        sum_x = _mm512_fmadd_ps(_mm512_mul_ps(_mm512_maskz_loadu_ps(lanes, s.gx + i), inv_cube), Dx, sum_x);
+        sum_y = _mm512_fmadd_ps(_mm512_mul_ps(_mm512_maskz_loadu_ps(lanes, s.gy + i), inv_cube), Dy, sum_y);
+    }
+
+    alignas(64) float lanes_x[16], lanes_y[16];
+    _mm512_store_ps(lanes_x, sum_x);
+    _mm512_store_ps(lanes_y, sum_y);
+    for (int lane = 0; lane < 16; lane++) {
+        ax += lanes_x[lane];
+        ay += lanes_y[lane];
+    }
+}
+
+#endif
+
+struct Point_Gravity_Implementation {
+    Add_Function add;
+    const char *isa;
+};
+
+static Point_Gravity_Implementation choose_implementation()
+{
+#ifdef POINT_GRAVITY_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        return {add_avx512, "AVX-512"};
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        return {add_avx2, "AVX2"};
+    if (__builtin_cpu_supports("sse2"))
+        return {add_sse, "SSE2"};
+#endif
+    return {add_scalar, "scalar"};
+}
+
+static const Point_Gravity_Implementation &implementation()
+{
+    static const Point_Gravity_Implementation chosen = choose_implementation();
+    return chosen;
+}
+
+void add_point_gravity(const Gravity_Sources &sources, size_t n, float px, float py, float &ax, float &ay)
+{
+    implementation().add(sources, n, px, py, ax, ay);
+}
+
+const char *point_gravity_isa()
+{
+    return implementation().isa;
+}
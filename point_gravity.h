@@ -0,0 +1,28 @@
+/*
+ * point_gravity.h
+ *
+ * Sums the pull of many point gravity sources on one particle. The sources are stored as one
+ * array per field, so they are evaluated 16, 8 or 4 at a time with AVX-512, AVX2 or SSE, using
+ * an approximate reciprocal square root refined with a Newton-Raphson step. The widest
+ * instruction set the CPU supports is chosen at run time; other CPUs use plain C++. The
+ * results of the instruction sets differ in the last bits.
+ */
+
+#pragma once
+
+#include <cstddef>
+
+// Point gravity sources, one array per field. gx and gy are the strengths along each axis.
+struct Gravity_Sources {
+    const float *x, *y, *gx, *gy;
+};
+
+/*
+  Adds the pull of n sources on a particle at px, py to ax and ay: for each source
+  g * D / |D|^3, where D is the distance from the particle to the source. Sources at the
+  particle's own position are skipped.
+*/
+void add_point_gravity(const Gravity_Sources &sources, size_t n, float px, float py, float &ax, float &ay);
+
+// Name of the instruction set used by add_point_gravity().
+const char *point_gravity_isa();
@@ -0,0 +1,198 @@
+/*
+ * profiler.cpp
+ *
+ * Implementation of the profiling zones, overlay and trace capture.
+ */
+
+#include "profiler.h"
+#include "base.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// ----------------------------------------------------------------------------
+// Internal state
+// ----------------------------------------------------------------------------
+static Profile_Zone *gFirstZone = nullptr;
+static Profile_Zone *gLastZone = nullptr;
+static int gDepth = 0;
+static bool gShowOverlay = false;
+
+// Toggles requested by the main thread, applied by profile_begin_frame() on the game thread
+static std::atomic<unsigned int> gOverlayToggles { 0 };
+static std::atomic<unsigned int> gTraceToggles { 0 };
+static std::atomic<const char *> gRequestedTraceFilename { nullptr };
+
+struct TraceEvent {
+    const char *name;
+    uint64_t start_ns;
+    uint64_t duration_ns;
+};
+
+static bool gTracing = false;
+static std::string gTraceFilename;
+static std::vector<TraceEvent> gTraceEvents;
+static uint64_t gFrameStart = 0;
+
+static uint64_t now_ns()
+{
+    using namespace std::chrono;
+    return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+// ----------------------------------------------------------------------------
+// Zones
+// ----------------------------------------------------------------------------
+Profile_Zone::Profile_Zone(const char *iname)
+    : name(iname)
+{
+    // Zones are listed in the order they are first entered
+    if (gLastZone)
+        gLastZone->next = this;
+    else
+        gFirstZone = this;
+    gLastZone = this;
+}
+
+Profile_Scope::Profile_Scope(Profile_Zone &izone, const unsigned long *icounter)
+    : zone(izone)
+    , counter(icounter)
+    , outermost(izone.active == 0)
+{
+    if (zone.depth < 0)
+        zone.depth = gDepth;
+    zone.active++;
+    gDepth++;
+
+    if (counter)
+        counter_start = *counter;
+    start_ns = now_ns();
+}
+
+Profile_Scope::~Profile_Scope()
+{
+    const uint64_t end_ns = now_ns();
+
+    // Time spent in a zone nested in itself is already included in the outer scope
+    if (outermost) {
+        zone.frame_ns += end_ns - start_ns;
+        if (counter)
+            zone.frame_count += *counter - counter_start;
+    }
+    if (gTracing)
+        gTraceEvents.push_back({ zone.name, start_ns, end_ns - start_ns });
+
+    zone.active--;
+    gDepth--;
+}
+
+static void toggle_trace(const char *filename);
+
+void profile_begin_frame()
+{
+    // Toggling twice before the frame starts cancels out
+    if (gOverlayToggles.exchange(0) % 2)
+        gShowOverlay = !gShowOverlay;
+    if (gTraceToggles.exchange(0) % 2)
+        toggle_trace(gRequestedTraceFilename);
+
+    const uint64_t frame_start = now_ns();
+    if (gTracing && gFrameStart)
+        gTraceEvents.push_back({ "frame", gFrameStart, frame_start - gFrameStart });
+    gFrameStart = frame_start;
+
+    for (Profile_Zone *zone = gFirstZone; zone; zone = zone->next) {
+        const double ms = zone->frame_ns / 1e6;
+        zone->average_ms += (ms - zone->average_ms) * 0.05;
+        zone->last_count = zone->frame_count;
+        zone->frame_ns = 0;
+        zone->frame_count = 0;
+    }
+}
+
+// ----------------------------------------------------------------------------
+// Overlay
+// ----------------------------------------------------------------------------
+void profile_toggle_overlay()
+{
+    gOverlayToggles++;
+}
+
+void profile_draw_overlay()
+{
+    if (!gShowOverlay)
+        return;
+
+    float y = 12;
+    draw_text(0, y, rgb(200, 200, 100), "zone                         ms      count");
+    for (Profile_Zone *zone = gFirstZone; zone; zone = zone->next) {
+        y += 10;
+        const int indent = max(zone->depth, 0) * 2;
+        draw_text(0,
+                  y,
+                  rgb(200, 200, 100),
+                  "%*s%-*s %6.3f %10lu",
+                  indent,
+                  "",
+                  24 - indent,
+                  zone->name,
+                  zone->average_ms,
+                  zone->last_count);
+    }
+    if (gTracing)
+        draw_text(0, y + 12, rgb(200, 100, 100), "capturing trace (%zu events)", gTraceEvents.size());
+}
+
+// ----------------------------------------------------------------------------
+// Trace capture
+// ----------------------------------------------------------------------------
+static void write_trace()
+{
+    FILE *file = std::fopen(gTraceFilename.c_str(), "w");
+    if (!file) {
+        print_error("Failed to write trace: %s", gTraceFilename.c_str());
+        return;
+    }
+
+    // Events are recorded when they end, so the first one is not necessarily the earliest
+    uint64_t origin = UINT64_MAX;
+    for (const TraceEvent &e : gTraceEvents)
+        origin = min(origin, e.start_ns);
+    std::fputs("{\"traceEvents\":[\n", file);
+    for (size_t i = 0; i < gTraceEvents.size(); i++) {
+        const TraceEvent &e = gTraceEvents[i];
+        std::fprintf(file,
+                     "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":%.3f,\"dur\":%.3f}%s\n",
+                     e.name,
+                     (e.start_ns - origin) / 1e3,
+                     e.duration_ns / 1e3,
+                     i + 1 < gTraceEvents.size() ? "," : "");
+    }
+    std::fputs("]}\n", file);
+    std::fclose(file);
+
+    std::printf("Wrote %zu trace events to %s\n", gTraceEvents.size(), gTraceFilename.c_str());
+}
+
+void profile_toggle_trace(const char *filename)
+{
+    gRequestedTraceFilename = filename;
+    gTraceToggles++;
+}
+
+static void toggle_trace(const char *filename)
+{
+    if (gTracing) {
+        gTracing = false;
+        write_trace();
+        gTraceEvents.clear();
+        gTraceEvents.shrink_to_fit();
+    } else {
+        gTracing = true;
+        gTraceFilename = filename;
+        gTraceEvents.reserve(1 << 16);
+    }
+}
@@ -0,0 +1,72 @@
+/*
+ * profiler.h
+ *
+ * Lightweight profiling zones. Put PROFILE_ZONE("name") at the start of a block to measure
+ * the time spent in it each frame. PROFILE_ZONE_COUNT("name", counter) additionally records by
+ * how much the given counter increased within the block.
+ *
+ * The results of the last frames can be shown as an overlay, and all zones of a number of
+ * frames can be captured as Chrome trace events (load the file in chrome://tracing or
+ * https://ui.perfetto.dev).
+ */
+
+#pragma once
+
+#include <cstdint>
+
+class Profile_Zone {
+public:
+    explicit Profile_Zone(const char *name);
+
+    const char *name;
+    int depth = -1; // Nesting depth, known once the zone has been entered
+    int active = 0; // Number of scopes currently in this zone
+
+    // Accumulated during the current frame
+    uint64_t frame_ns = 0;
+    unsigned long frame_count = 0;
+
+    // Results of the previous frames
+    double average_ms = 0.0;
+    unsigned long last_count = 0;
+
+    Profile_Zone *next = nullptr;
+};
+
+class Profile_Scope {
+public:
+    explicit Profile_Scope(Profile_Zone &zone, const unsigned long *counter = nullptr);
+    ~Profile_Scope();
+
+    Profile_Scope(const Profile_Scope &) = delete;
+    Profile_Scope &operator=(const Profile_Scope &) = delete;
+
+private:
+    Profile_Zone &zone;
+    const unsigned long *counter;
+    unsigned long counter_start = 0;
+    uint64_t start_ns;
+    bool outermost;
+};
+
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+#define PROFILE_ZONE_COUNT(name, counter)                                   \
+    static Profile_Zone PROFILE_CONCAT(profile_zone_, __LINE__)(name);      \
+    Profile_Scope PROFILE_CONCAT(profile_scope_, __LINE__)(PROFILE_CONCAT(profile_zone_, __LINE__), &(counter))
+#define PROFILE_ZONE(name)                                                  \
+    static Profile_Zone PROFILE_CONCAT(profile_zone_, __LINE__)(name);      \
+    Profile_Scope PROFILE_CONCAT(profile_scope_, __LINE__)(PROFILE_CONCAT(profile_zone_, __LINE__))
+
+/* Ends the previous frame, call once at the start of each frame */
+void profile_begin_frame();
+
+/* The toggles may be called from another thread, they take effect at the next
+   profile_begin_frame(). The filename must stay valid until then. */
+
+/* Overlay */
+void profile_toggle_overlay();
+void profile_draw_overlay();
+
+/* Trace capture, written to the given file when stopped */
+void profile_toggle_trace(const char *filename);
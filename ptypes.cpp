@@ -11,13 +11,13 @@
 
 #include <cstdio>
 
-extern Data data;
-
 //=====   BreakoutLevel   ===================================================================//
 
 BreakoutLevel::BreakoutLevel(BreakoutGame *imy_game, int level_nr)
     : my_game(imy_game)
 {
+    layer = DL_STATIC;
+
     int brick[14][20];
     FILE *file = nullptr;
 
@@ -28,31 +28,38 @@ BreakoutLevel::BreakoutLevel(BreakoutGame *imy_game, int level_nr)
     default: break;
     }
 
+    // Updated and drawn in this order: borders, pad, balls, bricks
+    level.register_type<Block>();
+    level.register_type<Pad>();
+    level.register_type<Ball>();
+    level.register_type<BrickField>();
+
+    bricks = level.add_particle<BrickField>(this, 44, 39, 14, 20);
     if (file) {
         std::fread(brick, 1, sizeof(brick), file);
         std::fclose(file);
         for (int x = 0; x < 14; x++) {
             for (int y = 0; y < 20; y++) {
                 if (brick[x][y] > 0)
-                    level.add_particle(new Brick(this, 44 + (16 + 32 * x), 39 + (8 + 16 * y), brick[x][y]));
+                    bricks->add_brick(x, y, brick[x][y]);
             }
         }
     }
 
-    Ball *first_ball = new Ball(this, SCREEN_W / 2.f, 0, 0, 0);
-    pad = new Pad((38 + 495) / 2.f, SCREEN_H - 24);
-    level.add_particle(first_ball);
-    level.add_particle(pad);
+    Ball *first_ball = level.add_particle<Ball>(this, SCREEN_W / 2.f, 0, 0, 0);
+    pad = level.add_particle<Pad>((38 + 495) / 2.f, SCREEN_H - 24);
     pad->attach_ball(first_ball);
 
     // Level borders
-    level.add_particle(new Block(0, 0, 38, SCREEN_H - 1)); // Left
-    level.add_particle(new Block(495, 0, SCREEN_W - 1, SCREEN_H - 1)); // Right
-    level.add_particle(new Block(38, 0, 495, 36)); // Top
+    level.add_particle<Block>(0, 0, 38, SCREEN_H - 1); // Left
+    level.add_particle<Block>(495, 0, SCREEN_W - 1, SCREEN_H - 1); // Right
+    level.add_particle<Block>(38, 0, 495, 36); // Top
 }
 
 void BreakoutLevel::initialize()
 {
+    level.random = system->random.split();
+    level.share_worker_threads(*system);
     play_sample(data.STARTUP_WAV);
 }
 
@@ -64,8 +71,7 @@ void BreakoutLevel::update(float dt)
     if (nr_of_balls == 0 && my_game->balls_left > -1) {
         my_game->balls_left--;
         if (my_game->balls_left >= 0) {
-            Ball *new_ball = new Ball(this, SCREEN_W / 2.f, 0, 0, 0);
-            level.add_particle(new_ball);
+            Ball *new_ball = level.add_particle<Ball>(this, SCREEN_W / 2.f, 0, 0, 0);
             pad->attach_ball(new_ball);
         }
     }
@@ -73,7 +79,8 @@ void BreakoutLevel::update(float dt)
 
 void BreakoutLevel::draw()
 {
-    level.draw_particles();
+    my_game->draw_static_layer();
+    level.draw_particles(system->interpolation());
 }
 
 void BreakoutLevel::remove()
@@ -86,16 +93,27 @@ void BreakoutLevel::add_to_score(int points)
     my_game->player_score += points;
 }
 
+void BreakoutLevel::draw_static()
+{
+    bricks->draw_static();
+}
+
+void BreakoutLevel::invalidate(float x1, float y1, float x2, float y2)
+{
+    my_game->invalidate_static(x1, y1, x2, y2);
+}
+
 //=====   BreakoutGame   ====================================================================//
 
 BreakoutGame::BreakoutGame()
-    : level(new BreakoutLevel(this, curr_level))
 {
+    layer = DL_HUD;
 }
 
 void BreakoutGame::initialize()
 {
-    system->add_particle(level);
+    static_layer = create_layer();
+    level = system->add_particle<BreakoutLevel>(this, curr_level);
 }
 void BreakoutGame::update(float dt)
 {
@@ -119,16 +137,15 @@ void BreakoutGame::update(float dt)
         } else {
             curr_level++;
             // Advance to the next level
-            level = new BreakoutLevel(this, curr_level);
-            system->add_particle(level);
+            level = system->add_particle<BreakoutLevel>(this, curr_level);
             level_finished = false;
+            invalidate_layer(static_layer);
         }
     }
 }
 
 void BreakoutGame::draw()
 {
-    draw_sprite(data.BORDER_BMP, 0.f, 0.f);
     draw_text(528, 40, rgb(100, 100, 100), "points");
     draw_text(528, 70, rgb(100, 100, 100), "level");
     draw_text(528, 100, rgb(100, 100, 100), "balls left");
@@ -137,24 +154,68 @@ void BreakoutGame::draw()
     draw_text(528, 113, rgb(100, 100, 200), " %d", balls_left);
 }
 
+void BreakoutGame::draw_static_layer()
+{
+    if (begin_layer(static_layer)) {
+        draw_sprite(data.BORDER_BMP, 0.f, 0.f);
+        level->draw_static();
+        end_layer(static_layer);
+    }
+    draw_layer(static_layer);
+}
+
+void BreakoutGame::remove()
+{
+    destroy_layer(static_layer);
+    static_layer = nullptr;
+}
+
+void BreakoutGame::invalidate_static(float x1, float y1, float x2, float y2)
+{
+    invalidate_layer(static_layer, x1, y1, x2, y2);
+}
+
 //=====   Brick   ===========================================================================//
 
 Brick::Brick(BreakoutLevel *imy_level, float ix, float iy, int ibrick_type)
-    : my_level(imy_level)
+    : x(ix)
+    , y(iy)
+    , my_level(imy_level)
     , brick_type(ibrick_type)
 {
-    type = P_BRICK;
-    x = ix;
-    y = iy;
-    w = (data.BRICK01_BMP)->w;
-    h = (data.BRICK01_BMP)->h;
-    o_type = ObstacleType::Rect;
-    life = 3;
     my_level->nr_of_bricks++;
 }
 
 void Brick::draw()
 {
+    if (!is_static())
+        draw_brick();
+}
+
+void Brick::draw_static()
+{
+    if (is_static())
+        draw_brick();
+}
+
+bool Brick::is_static() const
+{
+    // Only a brick that is fading away changes from frame to frame
+    return brick_type != 1 || life == 3;
+}
+
+void Brick::invalidate()
+{
+    const float w = (data.BRICK01_BMP)->w;
+    const float h = (data.BRICK01_BMP)->h;
+    my_level->invalidate(x - w / 2, y - h / 2, x + w / 2, y + h / 2);
+}
+
+void Brick::draw_brick()
+{
+    const float w = (data.BRICK01_BMP)->w;
+    const float h = (data.BRICK01_BMP)->h;
+
     switch (brick_type) {
     default:
         draw_rect(x - w / 2, y - h / 2, x + w / 2, y + h / 2, rgb(75, 0, 0));
@@ -200,6 +261,8 @@ void Brick::update(float dt)
 void Brick::collision(Particle *cp)
 {
     if (cp->type == P_BALL) {
+        invalidate();
+
         switch (brick_type) {
         case 1:
             if (life == 3) {
@@ -224,6 +287,7 @@ void Brick::collision(Particle *cp)
 void Brick::remove()
 {
     my_level->nr_of_bricks--;
+    invalidate();
 
     switch (brick_type) {
     case 1:  my_level->add_to_score(10); break;
@@ -234,6 +298,70 @@ void Brick::remove()
     }
 }
 
+//=====   BrickField   ======================================================================//
+
+BrickField::BrickField(BreakoutLevel *imy_level, float x_min, float y_min, int columns, int rows)
+    : Particle_Grid(x_min, y_min, columns, rows, (data.BRICK01_BMP)->w, (data.BRICK01_BMP)->h)
+    , my_level(imy_level)
+    , bricks(columns * rows)
+{
+    type = P_BRICK;
+    category = CC_BRICK;
+    layer = DL_BRICKS;
+}
+
+void BrickField::add_brick(int column, int row, int brick_type)
+{
+    const int cell = cell_index(column, row);
+    bricks[cell] = Brick(my_level, cell_x(column), cell_y(row), brick_type);
+    set_solid(cell, true);
+}
+
+void BrickField::update(float dt)
+{
+    bool fading = false;
+    for (int cell = 0; cell < columns * rows; cell++) {
+        if (!is_solid(cell) || is_removing(cell))
+            continue;
+        bricks[cell].update(dt);
+        if (bricks[cell].life <= 0)
+            remove_cell(cell); // The brick is removed with the dead particles
+        else if (!bricks[cell].is_static())
+            fading = true;
+    }
+
+    // Nothing happens until a ball hits a brick, which wakes the field
+    if (!fading)
+        sleep();
+}
+
+void BrickField::draw()
+{
+    for (int cell = 0; cell < columns * rows; cell++) {
+        if (is_solid(cell))
+            bricks[cell].draw();
+    }
+}
+
+void BrickField::draw_static()
+{
+    for (int cell = 0; cell < columns * rows; cell++) {
+        if (is_solid(cell))
+            bricks[cell].draw_static();
+    }
+}
+
+void BrickField::cell_collision(int cell, Particle *p)
+{
+    bricks[cell].collision(p);
+}
+
+void BrickField::cell_removed(int cell)
+{
+    bricks[cell].remove();
+    bricks[cell] = Brick();
+}
+
 //=====   Ball   ============================================================================//
 
 Ball::Ball(BreakoutLevel *imy_level, float ix, float iy, float idx, float idy)
@@ -246,7 +374,10 @@ Ball::Ball(BreakoutLevel *imy_level, float ix, float iy, float idx, float idy)
     dy = idy;
     w = h = (data.BALL01_BMP)->w;
     o_type = ObstacleType::Rect;
+    category = CC_BALL;
+    collides_with = CC_BALL | CC_BRICK | CC_PAD | CC_WALL; // Leave out CC_BALL to let balls pass each other
     affected_by_obstacle = true;
+    fast_mover = true;
     my_level->nr_of_balls++;
 }
 
@@ -296,6 +427,7 @@ Pad::Pad(float ix, float iy)
     w = (data.PAD01_BMP)->w;
     h = static_cast<float>((data.PAD01_BMP)->h) / 2;
     o_type = ObstacleType::Rect;
+    category = CC_PAD;
 }
 
 void Pad::update(float dt)
@@ -330,7 +462,7 @@ void Pad::update(float dt)
         rumble_gamepad(0x1400, 0x2400, 30);
 
         float speed = 300; // pixels per second
-        float angle = randf() - 0.5f;
+        float angle = system->random.randf() - 0.5f;
         attached_ball->dx = speed * sin(angle) + 0.75 * dx;
         attached_ball->dy = -speed * cos(angle);
     }
@@ -351,6 +483,8 @@ void Pad::attach_ball(Ball *the_ball)
     the_ball->dx = 0;
     the_ball->y = y - h / 2 - 4;
     the_ball->x = x;
+    the_ball->prev_x = the_ball->x; // Not drawn moving from where it was added
+    the_ball->prev_y = the_ball->y;
     attached_balls.push_back(the_ball);
 }
 
@@ -363,6 +497,13 @@ Block::Block(float ix_min, float iy_min, float ix_max, float iy_max)
     x = (ix_min + ix_max) * 0.5f;
     y = (iy_min + iy_max) * 0.5f;
     o_type = ObstacleType::Rect;
+    category = CC_WALL;
+}
+
+void Block::update(float dt)
+{
+    // Walls never change, and only wake when hit
+    sleep();
 }
 
 void Block::draw()
@@ -372,48 +513,51 @@ void Block::draw()
 
 //=====   Stars   ===========================================================================//
 
-Star::Star(float ix, float iy, float idx, float idy)
+StarField::StarField()
 {
-    x = ix;
-    dx = idx;
-    y = iy;
-    dy = idy;
-
-    int brightness;
-    float initial_speed = dy;
-
-    dy = (randf() * 0.9f + 0.1f) * dy;
-    if (initial_speed != 0)
-        brightness = static_cast<int>(std::clamp(255.f * (dy / initial_speed), 0.f, 255.f));
-    else {
-        life = 0;
-        brightness = 0;
-    }
-    color = rgba(255, 255, 255, brightness);
-}
-
-void Star::update(float dt)
-{
-    if (y > SCREEN_H)
-        life = 0;
-}
-void Star::draw()
-{
-    draw_point(x, y, color);
+    layer = DL_BACKGROUND;
 }
 
 void StarField::initialize()
 {
-    for (int i = 0; i < (SCREEN_H / 25) * int(1.0 / time_per_star); i++) {
-        system->add_particle(new Star(SCREEN_W * randf(), SCREEN_H * randf(), 0, 75));
+    stars.set_bounds(0, 0, SCREEN_W, SCREEN_H);
+
+    const int nr_of_stars = (SCREEN_H / 25) * int(1.0 / time_per_star);
+    std::vector<float> r(nr_of_stars * 3);
+    system->random.fill(r.data(), r.size());
+    for (int i = 0; i < nr_of_stars; i++) {
+        add_star(SCREEN_W * r[i * 3], SCREEN_H * r[i * 3 + 1], r[i * 3 + 2] * 0.9f + 0.1f);
     }
 }
 
 void StarField::update(float dt)
 {
+    stars.update_particles(dt);
+    last_dt = dt;
+
     time_passed += dt;
     while (time_passed > time_per_star) {
-        system->add_particle(new Star(SCREEN_W * randf(), 0, 0, 75));
+        add_star(SCREEN_W * system->random.randf(), 0, system->random.randf() * 0.9f + 0.1f);
         time_passed -= time_per_star;
     }
 }
+
+void StarField::draw()
+{
+    // Stars only move down, so they can be drawn in between updates by moving them back
+    const float t = (system->interpolation() - 1.f) * last_dt;
+    draw_y.resize(stars.size());
+    for (size_t i = 0; i < stars.size(); i++)
+        draw_y[i] = stars.y[i] + stars.dy[i] * t;
+
+    // All stars are drawn in one go, with their depth as opacity
+    draw_points(stars.size(), stars.x.data(), draw_y.data(), stars.alpha.data(), rgb(255, 255, 255));
+}
+
+void StarField::add_star(float ix, float iy, float depth)
+{
+    // Slower stars are further away, so they are dimmer.
+    const size_t i = stars.index_of(stars.add_particle(ix, iy, 0, depth * star_speed));
+    stars.alpha[i] = depth;
+    stars.flags[i] = PF_CULL;
+}
@@ -23,7 +23,16 @@ inline constexpr int P_BALL = static_cast<int>(ParticleType::Ball);
 inline constexpr int P_BRICK = static_cast<int>(ParticleType::Brick);
 inline constexpr int P_PAD = static_cast<int>(ParticleType::Pad);
 
+// Collision categories, see Particle::category
+enum CollisionCategory : uint32_t {
+    CC_BALL = 1 << 0,
+    CC_BRICK = 1 << 1,
+    CC_PAD = 1 << 2,
+    CC_WALL = 1 << 3
+};
+
 class BreakoutGame;
+class BrickField;
 class Pad;
 
 //=====   BreakoutLevel   ===================================================================//
@@ -37,12 +46,15 @@ public:
     void remove() override;
 
     void add_to_score(int points);
+    void draw_static();
+    void invalidate(float x1, float y1, float x2, float y2);
 
     int nr_of_bricks = 0;
     int nr_of_balls = 0;
+    BrickField *bricks = nullptr;
 
 private:
-    Particle_System level;
+    Particle_System_T<SF_OBSTACLES> level;
     BreakoutGame *my_game = nullptr;
     Pad *pad = nullptr;
 };
@@ -55,6 +67,10 @@ public:
     void initialize() override;
     void update(float dt) override;
     void draw() override;
+    void remove() override;
+
+    void draw_static_layer();
+    void invalidate_static(float x1, float y1, float x2, float y2);
 
     bool level_finished = false;
     int player_score = 0;
@@ -64,23 +80,54 @@ private:
     float time_played = 0.f;
     int curr_level = 1;
     BreakoutLevel *level = nullptr;
+    Layer *static_layer = nullptr; // Border and bricks that are not changing
 };
 
 //=====   Brick   ===========================================================================//
 
-class Brick : public Particle {
+// A brick is not a particle of its own, but a cell of the level's BrickField.
+class Brick {
 public:
+    Brick() = default;
     Brick(BreakoutLevel *my_level, float x, float y, int brick_type);
-    void draw() override;
-    void update(float dt) override;
-    void collision(Particle *cp) override;
-    void remove() override;
+    void draw();
+    void update(float dt);
+    void collision(Particle *cp);
+    void remove();
+
+    void draw_static();
+    [[nodiscard]] bool is_static() const;
+
+    float x = 0.f, y = 0.f;
+    float life = 3.f; // The brick is removed when life drops to 0
 
 private:
+    void invalidate();
+    void draw_brick();
+
     BreakoutLevel *my_level = nullptr;
     unsigned short brick_type = 0;
 };
 
+//=====   BrickField   ======================================================================//
+
+// All bricks of a level, as a single obstacle on the grid of the level file.
+class BrickField : public Particle_Grid {
+public:
+    BrickField(BreakoutLevel *my_level, float x_min, float y_min, int columns, int rows);
+    void update(float dt) override;
+    void draw() override;
+    void cell_collision(int cell, Particle *p) override;
+    void cell_removed(int cell) override;
+
+    void add_brick(int column, int row, int brick_type);
+    void draw_static();
+
+private:
+    BreakoutLevel *my_level = nullptr;
+    std::vector<Brick> bricks; // One for each cell, only those of solid cells exist
+};
+
 //=====   Ball   ============================================================================//
 
 class Ball : public Particle {
@@ -114,28 +161,26 @@ private:
 class Block : public Particle {
 public:
     Block(float ix_min, float iy_min, float ix_max, float iy_max);
+    void update(float dt) override;
     void draw() override;
 };
 
 //=====   Stars   ===========================================================================//
 
-class Star : public Particle {
-public:
-    Star(float x, float y, float dx, float dy);
-    void update(float dt) override;
-    void draw() override;
-
-private:
-    Color color = rgb(255, 255, 255);
-};
-
 class StarField : public Particle {
 public:
-    StarField() = default;
+    StarField();
     void initialize() override;
     void update(float dt) override;
+    void draw() override;
 
 private:
+    void add_star(float x, float y, float depth);
+
+    Particle_Array stars;
+    std::vector<float> draw_y; // Interpolated star positions
+    float last_dt = 0.f;
+    float star_speed = 75.f;
     float time_passed = 0.f;
     float time_per_star = 1.f / 40.f;
 };
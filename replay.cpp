@@ -0,0 +1,129 @@
+/*
+ * replay.cpp
+ *
+ * Implementation of input recording and playback. The file format is:
+ *
+ *   "BKRP"          magic
+ *   uint32_t        version
+ *   uint64_t        seed
+ *   float           simulation steps per second
+ *   per frame:
+ *     uint8_t       keys, bit n is set when key[n] is down
+ *     float         gamepad stick x
+ *     float         delta time
+ *
+ * Numbers are stored in the byte order of the machine that made the recording.
+ */
+
+#include "replay.h"
+#include "base.h"
+
+#include <cstdio>
+#include <cstring>
+#include <iterator>
+
+static constexpr char REPLAY_MAGIC[4] = { 'B', 'K', 'R', 'P' };
+static constexpr uint32_t REPLAY_VERSION = 2;
+
+static FILE *gReplayFile = nullptr;
+static bool gRecording = false;
+
+bool start_recording(const char *filename, uint64_t seed, float rate)
+{
+    stop_replay();
+
+    gReplayFile = std::fopen(filename, "wb");
+    if (!gReplayFile) {
+        print_error("Failed to open %s for recording", filename);
+        return false;
+    }
+
+    std::fwrite(REPLAY_MAGIC, 1, sizeof(REPLAY_MAGIC), gReplayFile);
+    std::fwrite(&REPLAY_VERSION, sizeof(REPLAY_VERSION), 1, gReplayFile);
+    std::fwrite(&seed, sizeof(seed), 1, gReplayFile);
+    std::fwrite(&rate, sizeof(rate), 1, gReplayFile);
+    gRecording = true;
+    return true;
+}
+
+bool start_playback(const char *filename, uint64_t &seed, float &rate)
+{
+    stop_replay();
+
+    gReplayFile = std::fopen(filename, "rb");
+    if (!gReplayFile) {
+        print_error("Failed to open recording %s", filename);
+        return false;
+    }
+
+    char magic[4];
+    uint32_t version = 0;
+    if (std::fread(magic, 1, sizeof(magic), gReplayFile) != sizeof(magic) ||
+        std::memcmp(magic, REPLAY_MAGIC, sizeof(magic)) != 0 ||
+        std::fread(&version, sizeof(version), 1, gReplayFile) != 1 || version != REPLAY_VERSION ||
+        std::fread(&seed, sizeof(seed), 1, gReplayFile) != 1 ||
+        std::fread(&rate, sizeof(rate), 1, gReplayFile) != 1 || !(rate > 0)) {
+        print_error("%s is not a recording made by this version", filename);
+        stop_replay();
+        return false;
+    }
+
+    gRecording = false;
+    return true;
+}
+
+void stop_replay()
+{
+    if (gReplayFile)
+        std::fclose(gReplayFile);
+    gReplayFile = nullptr;
+    gRecording = false;
+}
+
+bool is_recording()
+{
+    return gReplayFile && gRecording;
+}
+
+bool is_playing()
+{
+    return gReplayFile && !gRecording;
+}
+
+void record_input(float stick_x)
+{
+    if (!is_recording())
+        return;
+
+    uint8_t keys = 0;
+    for (int k : { KEY_QUIT, KEY_LEFT, KEY_RIGHT, KEY_ACTION }) {
+        if (key[k])
+            keys |= 1 << k;
+    }
+    const float dt = delta_time;
+
+    std::fwrite(&keys, sizeof(keys), 1, gReplayFile);
+    std::fwrite(&stick_x, sizeof(stick_x), 1, gReplayFile);
+    std::fwrite(&dt, sizeof(dt), 1, gReplayFile);
+}
+
+bool play_input(float &stick_x)
+{
+    uint8_t keys = 0;
+    float dt = 0.f;
+
+    if (!is_playing() || std::fread(&keys, sizeof(keys), 1, gReplayFile) != 1 ||
+        std::fread(&stick_x, sizeof(stick_x), 1, gReplayFile) != 1 ||
+        std::fread(&dt, sizeof(dt), 1, gReplayFile) != 1) {
+        stop_replay();
+        std::fill(std::begin(key), std::end(key), 0);
+        key[KEY_QUIT] = 1;
+        stick_x = 0.f;
+        return false;
+    }
+
+    for (int k : { KEY_QUIT, KEY_LEFT, KEY_RIGHT, KEY_ACTION })
+        key[k] = (keys >> k) & 1;
+    delta_time = dt;
+    return true;
+}
@@ -0,0 +1,27 @@
+/*
+ * replay.h
+ *
+ * Recording and playback of the input of each frame, so a session can be replayed exactly,
+ * for example as a benchmark workload.
+ *
+ * A recording starts with the seed of the random number generator and the simulation rate,
+ * followed by the state of the keys, the gamepad stick and the delta time of each frame.
+ */
+
+#pragma once
+
+#include <cstdint>
+
+[[nodiscard]] bool start_recording(const char *filename, uint64_t seed, float rate);
+[[nodiscard]] bool start_playback(const char *filename, uint64_t &seed, float &rate);
+void stop_replay();
+
+[[nodiscard]] bool is_recording();
+[[nodiscard]] bool is_playing();
+
+/* Writes key[], the gamepad stick and delta_time of this frame to the recording */
+void record_input(float stick_x);
+
+/* Sets key[], the gamepad stick and delta_time from the recording. At the end of the
+ * recording KEY_QUIT is pressed and false is returned. */
+bool play_input(float &stick_x);
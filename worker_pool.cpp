@@ -0,0 +1,101 @@
+/*
+ * worker_pool.cpp
+ *
+ * Implementation of the worker threads and their work stealing loop.
+ */
+
+#include "worker_pool.h"
+
+#include <algorithm>
+
+Worker_Pool::Worker_Pool(unsigned int inr_of_threads)
+    : nr_of_threads(std::max(inr_of_threads, 1u))
+{
+#if defined(__EMSCRIPTEN__) && !defined(__EMSCRIPTEN_PTHREADS__)
+    nr_of_threads = 1; // Built without thread support
+#endif
+    queues.reset(new Queue[nr_of_threads]);
+    for (unsigned int worker = 1; worker < nr_of_threads; worker++)
+        threads.emplace_back(&Worker_Pool::thread_main, this, worker);
+}
+
+Worker_Pool::~Worker_Pool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    job_started.notify_all();
+    for (auto &thread : threads)
+        thread.join();
+}
+
+void Worker_Pool::run(size_t n, size_t chunk_size, Job_Function fn, void *context)
+{
+    chunk_size = std::max<size_t>(chunk_size, 1);
+    const size_t nr_of_chunks = (n + chunk_size - 1) / chunk_size;
+
+    if (nr_of_threads == 1 || nr_of_chunks <= 1) {
+        for (size_t begin = 0; begin < n; begin += chunk_size)
+            fn(context, begin, std::min(n, begin + chunk_size), 0);
+        return;
+    }
+
+    // Each thread starts with an equal, contiguous share of the chunks
+    for (unsigned int worker = 0; worker < nr_of_threads; worker++) {
+        queues[worker].next.store(nr_of_chunks * worker / nr_of_threads, std::memory_order_relaxed);
+        queues[worker].end = nr_of_chunks * (worker + 1) / nr_of_threads;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        job_fn = fn;
+        job_context = context;
+        job_size = n;
+        job_chunk_size = chunk_size;
+        busy_threads = nr_of_threads - 1;
+        job_generation++;
+    }
+    job_started.notify_all();
+
+    work(0);
+
+    std::unique_lock<std::mutex> lock(mutex);
+    job_finished.wait(lock, [this] { return busy_threads == 0; });
+}
+
+void Worker_Pool::work(unsigned int worker)
+{
+    // Empty the own queue first, then steal from the others
+    for (unsigned int i = 0; i < nr_of_threads; i++) {
+        Queue &queue = queues[(worker + i) % nr_of_threads];
+        for (;;) {
+            const size_t chunk = queue.next.fetch_add(1, std::memory_order_relaxed);
+            if (chunk >= queue.end)
+                break;
+            const size_t begin = chunk * job_chunk_size;
+            job_fn(job_context, begin, std::min(job_size, begin + job_chunk_size), worker);
+        }
+    }
+}
+
+void Worker_Pool::thread_main(unsigned int worker)
+{
+    unsigned int generation = 0;
+
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            job_started.wait(lock, [&] { return stopping || job_generation != generation; });
+            if (stopping)
+                return;
+            generation = job_generation;
+        }
+
+        work(worker);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (--busy_threads == 0)
+            job_finished.notify_one();
+    }
+}
@@ -0,0 +1,76 @@
+/*
+ * worker_pool.h
+ *
+ * A small pool of worker threads for data parallel loops. parallel_for() splits a range into
+ * chunks, hands each thread an equal share of them and lets threads that run out of work steal
+ * chunks from the others, so an uneven load still keeps all threads busy. The calling thread
+ * takes part in the work and parallel_for() returns when all chunks are done.
+ *
+ * A pool of one thread starts no threads at all and runs the chunks in order on the caller.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+class Worker_Pool {
+public:
+    explicit Worker_Pool(unsigned int nr_of_threads = 1);
+    ~Worker_Pool();
+    Worker_Pool(const Worker_Pool &) = delete;
+    Worker_Pool &operator=(const Worker_Pool &) = delete;
+
+    // Number of threads working on a loop, including the calling thread.
+    [[nodiscard]] unsigned int size() const { return nr_of_threads; }
+
+    /*
+      Calls fn(begin, end, worker) for each chunk [begin, end) of [0, n). Chunks start at a
+      multiple of chunk_size, worker is in [0, size()) and identifies the thread running it,
+      so it can index per thread scratch data. fn must not call parallel_for() itself.
+    */
+    template <typename Fn>
+    void parallel_for(size_t n, size_t chunk_size, Fn &&fn)
+    {
+        auto call = [](void *context, size_t begin, size_t end, unsigned int worker) {
+            (*static_cast<std::remove_reference_t<Fn> *>(context))(begin, end, worker);
+        };
+        run(n, chunk_size, call, &fn);
+    }
+
+private:
+    using Job_Function = void (*)(void *context, size_t begin, size_t end, unsigned int worker);
+
+    // Chunks still to be done by one thread. The owner and thieves all take from the front.
+    struct alignas(64) Queue {
+        std::atomic<size_t> next {0};
+        size_t end = 0;
+    };
+
+    void run(size_t n, size_t chunk_size, Job_Function fn, void *context);
+    void work(unsigned int worker);
+    void thread_main(unsigned int worker);
+
+    unsigned int nr_of_threads;
+    std::unique_ptr<Queue[]> queues;
+    std::vector<std::thread> threads;
+
+    // Current job
+    Job_Function job_fn = nullptr;
+    void *job_context = nullptr;
+    size_t job_size = 0;
+    size_t job_chunk_size = 1;
+
+    std::mutex mutex;
+    std::condition_variable job_started;
+    std::condition_variable job_finished;
+    unsigned int job_generation = 0; // Incremented for each job, threads wait for a change
+    unsigned int busy_threads = 0;
+    bool stopping = false;
+};